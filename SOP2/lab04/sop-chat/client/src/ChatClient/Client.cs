@@ -1,3 +1,6 @@
+using System;
+using System.Buffers.Binary;
+using System.Collections.Generic;
 using System.IO;
 using System.Net.Sockets;
 using System.Text;
@@ -13,6 +16,15 @@ public class Client
     public const int MessageOffset = NameSize;
     public const int MessageSize = 448;
     public const int BuffSize = NameSize + MessageSize;
+
+    public const int FramedMagicOffset = BuffSize - 8;
+    public const string FramedRequest = "SOPF1";
+    public const string FramedAccept = "SOPA1";
+    public const int FrameHeaderSize = 3;
+    public const int FrameIdSize = 4;
+    public const int FrameSequenceSize = 4;
+    public const byte FrameMessage = 1;
+    public const byte FrameName = 2;
     
     public string Name { get; set; } = "Unauthorized";
     public TcpClient TcpClient { get; }
@@ -21,6 +33,9 @@ public class Client
     public StreamReader Reader { get; }
     public StreamWriter Writer { get; }
     public CancellationTokenSource Cancellation { get; } = new CancellationTokenSource();
+    public bool Framed { get; set; }
+    public Dictionary<uint, string> Names { get; } = new Dictionary<uint, string>();
+    public uint LastSequence { get; private set; }
 
     public Client(TcpClient tcpClient)
     {
@@ -29,4 +44,58 @@ public class Client
         Reader = new StreamReader(NetworkStream, Encoding.ASCII);
         Writer = new StreamWriter(NetworkStream, Encoding.ASCII) { AutoFlush = true };
     }
-}
\ No newline at end of file
+
+    public void WriteMessage(string name, string text)
+    {
+        if (!Framed)
+        {
+            var buffer = new byte[BuffSize];
+            Encoding.ASCII.GetBytes(name, 0, Math.Min(NameSize, name.Length), buffer, NameOffset);
+            Encoding.ASCII.GetBytes(text, 0, Math.Min(MessageSize, text.Length), buffer, MessageOffset);
+            NetworkStream.Write(buffer);
+            NetworkStream.Flush();
+            return;
+        }
+
+        var length = Math.Min(MessageSize - 1, text.Length);
+        var frame = new byte[FrameHeaderSize + length];
+        BinaryPrimitives.WriteUInt16BigEndian(frame, (ushort)length);
+        frame[2] = FrameMessage;
+        Encoding.ASCII.GetBytes(text, 0, length, frame, FrameHeaderSize);
+        NetworkStream.Write(frame);
+        NetworkStream.Flush();
+    }
+
+    public (string Name, string Text) ReadMessage()
+    {
+        if (!Framed)
+        {
+            var buffer = new byte[BuffSize];
+            NetworkStream.ReadExactly(buffer);
+            var name = Encoding.ASCII.GetString(buffer, NameOffset, NameSize).TrimEnd('\0');
+            var text = Encoding.ASCII.GetString(buffer, MessageOffset, MessageSize).TrimEnd('\0');
+            return (name, text);
+        }
+
+        var header = new byte[FrameHeaderSize];
+        while (true)
+        {
+            NetworkStream.ReadExactly(header);
+            var payload = new byte[BinaryPrimitives.ReadUInt16BigEndian(header)];
+            NetworkStream.ReadExactly(payload);
+            var id = BinaryPrimitives.ReadUInt32BigEndian(payload);
+            if (header[2] == FrameName)
+            {
+                Names[id] = Encoding.ASCII.GetString(payload, FrameIdSize, payload.Length - FrameIdSize);
+            }
+            else if (header[2] == FrameMessage)
+            {
+                var sequence = BinaryPrimitives.ReadUInt32BigEndian(payload.AsSpan(FrameIdSize));
+                if (sequence != 0)
+                    LastSequence = sequence;
+                var offset = FrameIdSize + FrameSequenceSize;
+                return (Names.GetValueOrDefault(id, $"#{id}"), Encoding.ASCII.GetString(payload, offset, payload.Length - offset));
+            }
+        }
+    }
+}
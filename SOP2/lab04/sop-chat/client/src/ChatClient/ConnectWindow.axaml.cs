@@ -80,6 +80,9 @@ public partial class ConnectWindow : Window
         var port = ushort.Parse(portText);
         var username = Username.Trim();
         var key = Key;
+        // The framed request follows the key in the handshake frame.
+        var maxKeyLength = Client.FramedMagicOffset - Client.MessageOffset - 1;
+        if (key.Length > maxKeyLength) throw new Exception($"Key longer than {maxKeyLength} characters");
         
         var ip = Array.Find(host.AddressList, addr => addr.AddressFamily == AddressFamily.InterNetwork);
         if (ip == null) throw new Exception("Failed to resolve address");
@@ -91,10 +94,13 @@ public partial class ConnectWindow : Window
         var buffer = new byte[Client.BuffSize];
         
         Encoding.ASCII.GetBytes(username, 0, Math.Min(Client.NameSize, username.Length), buffer, Client.NameOffset);
-        Encoding.ASCII.GetBytes(key, 0, Math.Min(Client.MessageSize, key.Length), buffer, Client.MessageOffset);
+        Encoding.ASCII.GetBytes(key, 0, key.Length, buffer, Client.MessageOffset);
+        Encoding.ASCII.GetBytes(Client.FramedRequest, 0, Client.FramedRequest.Length, buffer, Client.FramedMagicOffset);
         client.NetworkStream.Write(buffer, 0, Client.BuffSize);
         client.NetworkStream.Flush();
         client.NetworkStream.ReadExactly(buffer);
+        // Servers without framed messages echo the request back unchanged.
+        client.Framed = Encoding.ASCII.GetString(buffer, Client.FramedMagicOffset, Client.FramedAccept.Length) == Client.FramedAccept;
 
         Client = client;
     }
@@ -3,7 +3,6 @@ using Avalonia.Controls;
 using Avalonia.Input;
 using Avalonia.Interactivity;
 using System.Collections.ObjectModel;
-using System.Text;
 using System.Threading.Tasks;
 using Avalonia.Threading;
 
@@ -69,11 +68,18 @@ public partial class MainWindow : Window
         await connectWindow.ShowDialog(this);
         if (connectWindow.Client is not null)
         {
+            // Catch up on what was missed since the previous connection dropped.
+            var lastSequence = Client?.LastSequence ?? 0;
             Client = connectWindow.Client;
             Username = connectWindow.Username;
             if (Client.Connected)
             {
                 AddMessage(new StatusMessage("Connected"));
+                if (Client.Framed && lastSequence > 0)
+                {
+                    var client = Client;
+                    await Task.Run(() => client.WriteMessage(Username, $"/history {lastSequence}"));
+                }
                 
                 ConnectMenuItem.IsEnabled = false;
                 await Task.Run(ReadMessages);
@@ -95,13 +101,9 @@ public partial class MainWindow : Window
         var client = Client;
         if (client == null) return;
         
-        byte[] buffer = new byte[Client.BuffSize];
         try
         {
-            Encoding.ASCII.GetBytes(Username, 0, Math.Min(Client.NameSize, Username.Length), buffer, Client.NameOffset);
-            Encoding.ASCII.GetBytes(message.Text, 0, Math.Min(Client.MessageSize, message.Text.Length), buffer, Client.MessageOffset);
-            client.NetworkStream.Write(buffer);
-            client.NetworkStream.Flush();
+            client.WriteMessage(Username, message.Text);
         }
         catch (Exception e)
         {
@@ -113,14 +115,11 @@ public partial class MainWindow : Window
     {
         var client = Client;
         if (client == null) return;
-        var buffer = new byte[Client.BuffSize];
         try
         {
             while (client.Connected)
             {
-                client.NetworkStream.ReadExactly(buffer);
-                var name = Encoding.ASCII.GetString(buffer, Client.NameOffset, Client.NameSize).TrimEnd('\0');
-                var message = Encoding.ASCII.GetString(buffer, Client.MessageOffset, Client.MessageSize).TrimEnd('\0');
+                var (name, message) = client.ReadMessage();
                 Dispatcher.UIThread.Invoke(() => AddMessage(new ChatMessage(name, message, DateTime.Now)));
             }
         }
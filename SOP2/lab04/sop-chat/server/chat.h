@@ -0,0 +1,56 @@
+#pragma once
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(expression)             \
+    (__extension__({                               \
+        long int __result;                         \
+        do                                         \
+            __result = (long int)(expression);     \
+        while (__result == -1L && errno == EINTR); \
+        __result;                                  \
+    }))
+#endif
+
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+#define UNUSED(x) (void)(x)
+
+#define NAME_OFFSET 0
+#define NAME_SIZE 64
+#define MESSAGE_OFFSET NAME_SIZE
+#define MESSAGE_SIZE 448
+#define BUFF_SIZE (NAME_SIZE + MESSAGE_SIZE)
+
+/*
+ * Framed protocol
+ *
+ * A client asks for it by putting FRAMED_REQUEST at FRAMED_MAGIC_OFFSET of its
+ * handshake frame, behind the NUL-terminated key. A server which supports it
+ * answers with FRAMED_ACCEPT at the same place of the echoed frame, any other
+ * reply means the connection stays on fixed 512-byte frames.
+ *
+ * Afterwards every frame is a FRAME_HEADER_SIZE header (payload length as
+ * a big-endian uint16_t followed by the frame type) and the payload:
+ * - FRAME_MESSAGE from a client: message text,
+ * - FRAME_MESSAGE from the server: big-endian uint32_t sender id, big-endian
+ *   uint32_t sequence number, message text. Room messages are numbered in
+ *   the order they were sent, a direct message has the number 0,
+ * - FRAME_NAME from the server: sender id, sender name. It is sent before the
+ *   first message of a sender the client may not know yet, ids are never reused.
+ */
+#define FRAMED_MAGIC_OFFSET (BUFF_SIZE - 8)
+#define FRAMED_REQUEST "SOPF1"
+#define FRAMED_ACCEPT "SOPA1"
+#define FRAMED_MAGIC_SIZE sizeof(FRAMED_REQUEST)
+
+#define FRAME_HEADER_SIZE 3
+#define FRAME_ID_SIZE 4
+#define FRAME_SEQUENCE_SIZE 4
+#define FRAME_MAX_PAYLOAD (FRAME_ID_SIZE + FRAME_SEQUENCE_SIZE + MESSAGE_SIZE)
+
+#define FRAME_MESSAGE 1
+#define FRAME_NAME 2
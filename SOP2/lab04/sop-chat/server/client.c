@@ -0,0 +1,257 @@
+#include "client.h"
+
+#include <string.h>
+
+#define CLIENT_INDEX_MIN_BUCKETS 64
+
+// FNV-1a
+uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void client_reset(client_t *client)
+{
+    client->fd = -1;
+    client->state = CLIENT_HANDSHAKE;
+    wheel_timer_init(&client->timer);
+    client->last_active = 0;
+    client->framed = 0;
+    client->id = 0;
+    client->name_frame = NULL;
+    memset(client->known_senders, 0, sizeof(client->known_senders));
+    client->request_counter = 0;
+    memset(client->name, 0, NAME_SIZE);
+    client->events = 0;
+    client->in_len = 0;
+    send_queue_init(&client->out);
+    client->write_blocked = 0;
+    client->inflight = 0;
+    client->receiving = 0;
+    client->dropped = 0;
+    client->tokens = 0;
+    client->refilled_at = 0;
+    client->rate_dropped = 0;
+    client->held = 0;
+    client->held_pass = 0;
+    client->resume_at = 0;
+    client->pending_flush = 0;
+    client->prev = NULL;
+    client->next = NULL;
+    client->flush_prev = NULL;
+    client->flush_next = NULL;
+    client->held_prev = NULL;
+    client->held_next = NULL;
+    client->room = NULL;
+    client->room_prev = NULL;
+    client->room_next = NULL;
+    client->index_next = NULL;
+}
+
+void client_slab_init(client_slab_t *slab, int max_count)
+{
+    slab->chunks = NULL;
+    slab->chunk_count = 0;
+    slab->chunk_capacity = 0;
+    slab->free_list = NULL;
+    slab->released = NULL;
+    slab->live = NULL;
+    slab->count = 0;
+    slab->max_count = max_count;
+}
+
+static void client_slab_grow(client_slab_t *slab)
+{
+    if (slab->chunk_count == slab->chunk_capacity)
+    {
+        int capacity = slab->chunk_capacity ? 2 * slab->chunk_capacity : 8;
+        client_t **chunks = realloc(slab->chunks, capacity * sizeof(client_t *));
+        if (chunks == NULL)
+            ERR("realloc");
+        slab->chunks = chunks;
+        slab->chunk_capacity = capacity;
+    }
+
+    client_t *chunk = malloc(CLIENT_CHUNK_SIZE * sizeof(client_t));
+    if (chunk == NULL)
+        ERR("malloc");
+    slab->chunks[slab->chunk_count++] = chunk;
+
+    for (int i = CLIENT_CHUNK_SIZE - 1; i >= 0; i--)
+    {
+        client_reset(&chunk[i]);
+        chunk[i].next = slab->free_list;
+        slab->free_list = &chunk[i];
+    }
+}
+
+client_t *client_slab_alloc(client_slab_t *slab)
+{
+    if (slab->count >= slab->max_count)
+        return NULL;
+    if (slab->free_list == NULL)
+        client_slab_grow(slab);
+
+    client_t *client = slab->free_list;
+    slab->free_list = client->next;
+    client_reset(client);
+
+    client->next = slab->live;
+    if (slab->live != NULL)
+        slab->live->prev = client;
+    slab->live = client;
+    slab->count++;
+    return client;
+}
+
+void client_slab_free(client_slab_t *slab, client_t *client)
+{
+    if (client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        slab->live = client->next;
+    if (client->next != NULL)
+        client->next->prev = client->prev;
+
+    send_queue_clear(&client->out);
+    if (client->name_frame != NULL)
+        message_unref(client->name_frame);
+    client_reset(client);
+    client->next = slab->released;
+    slab->released = client;
+    slab->count--;
+}
+
+// Makes the released slots free, once no event of the batch which released them is left.
+void client_slab_recycle(client_slab_t *slab)
+{
+    while (slab->released != NULL)
+    {
+        client_t *client = slab->released;
+        slab->released = client->next;
+        client->next = slab->free_list;
+        slab->free_list = client;
+    }
+}
+
+void client_slab_destroy(client_slab_t *slab)
+{
+    for (client_t *client = slab->live; client != NULL; client = client->next)
+    {
+        send_queue_clear(&client->out);
+        if (client->name_frame != NULL)
+            message_unref(client->name_frame);
+    }
+    for (int i = 0; i < slab->chunk_count; i++)
+        free(slab->chunks[i]);
+    free(slab->chunks);
+    client_slab_init(slab, slab->max_count);
+}
+
+void client_index_init(client_index_t *index)
+{
+    index->bucket_count = CLIENT_INDEX_MIN_BUCKETS;
+    index->count = 0;
+    if ((index->buckets = calloc(index->bucket_count, sizeof(client_t *))) == NULL)
+        ERR("calloc");
+    for (int i = 0; i < CLIENT_INDEX_PRESENCE_SLOTS; i++)
+        atomic_store_explicit(&index->presence[i], 0, memory_order_relaxed);
+}
+
+// Pairs with the acquire load of client_index_maybe_present, like room_presence_add.
+static void client_index_presence_add(client_index_t *index, uint32_t hash, int delta)
+{
+    atomic_fetch_add_explicit(&index->presence[hash & (CLIENT_INDEX_PRESENCE_SLOTS - 1)], delta,
+                              memory_order_release);
+}
+
+// Whether a client with the given name hash may be in the index, safe to call from any thread.
+int client_index_maybe_present(client_index_t *index, uint32_t hash)
+{
+    return atomic_load_explicit(&index->presence[hash & (CLIENT_INDEX_PRESENCE_SLOTS - 1)], memory_order_acquire) > 0;
+}
+
+static void client_index_grow(client_index_t *index)
+{
+    int bucket_count = 2 * index->bucket_count;
+    client_t **buckets = calloc(bucket_count, sizeof(client_t *));
+    if (buckets == NULL)
+        ERR("calloc");
+
+    for (int i = 0; i < index->bucket_count; i++)
+    {
+        client_t *next;
+        for (client_t *client = index->buckets[i]; client != NULL; client = next)
+        {
+            next = client->index_next;
+            client_t **bucket = &buckets[name_hash(client->name) & (bucket_count - 1)];
+            client->index_next = *bucket;
+            *bucket = client;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+}
+
+void client_index_add(client_index_t *index, client_t *client)
+{
+    if (index->count >= index->bucket_count)
+        client_index_grow(index);
+
+    uint32_t hash = name_hash(client->name);
+    client_t **bucket = &index->buckets[hash & (index->bucket_count - 1)];
+    client->index_next = *bucket;
+    *bucket = client;
+    index->count++;
+    client_index_presence_add(index, hash, 1);
+}
+
+void client_index_remove(client_index_t *index, client_t *client)
+{
+    uint32_t hash = name_hash(client->name);
+    client_t **link = &index->buckets[hash & (index->bucket_count - 1)];
+    while (*link != NULL && *link != client)
+        link = &(*link)->index_next;
+    if (*link == NULL)
+        return;
+    *link = client->index_next;
+    client->index_next = NULL;
+    index->count--;
+    client_index_presence_add(index, hash, -1);
+}
+
+static client_t *client_index_match(client_t *client, const char *name)
+{
+    while (client != NULL && strcmp(client->name, name) != 0)
+        client = client->index_next;
+    return client;
+}
+
+/*
+ * Returns the first client with the given name, client_index_next
+ * walks through the others.
+ */
+client_t *client_index_find(client_index_t *index, const char *name)
+{
+    return client_index_match(index->buckets[name_hash(name) & (index->bucket_count - 1)], name);
+}
+
+client_t *client_index_next(client_t *client)
+{
+    return client_index_match(client->index_next, client->name);
+}
+
+void client_index_destroy(client_index_t *index)
+{
+    free(index->buckets);
+    index->buckets = NULL;
+    index->bucket_count = 0;
+    index->count = 0;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "message.h"
+#include "wheel.h"
+
+#define CLIENT_CHUNK_SIZE 256
+#define KNOWN_SENDERS 64
+// Like ROOM_PRESENCE_SLOTS, a power of two.
+#define CLIENT_INDEX_PRESENCE_SLOTS 4096
+// Room for several messages, so one read can pick up a whole burst.
+#define CLIENT_IN_SIZE (8 * BUFF_SIZE)
+
+typedef enum client_state_t
+{
+    CLIENT_HANDSHAKE,
+    CLIENT_ACTIVE,
+    // Disconnected, waiting for its io_uring requests to complete.
+    CLIENT_CLOSED,
+} client_state_t;
+
+struct room_t;
+
+typedef struct client_t
+{
+    int fd;
+    client_state_t state;
+    // Handshake timeout, then idle timeout, last_active is the wheel tick of the last read.
+    wheel_timer_t timer;
+    uint64_t last_active;
+    int framed;
+    uint32_t id;
+    message_t *name_frame;
+    // Direct-mapped cache of the senders this client already got a FRAME_NAME for.
+    uint32_t known_senders[KNOWN_SENDERS];
+    char name[NAME_SIZE];
+    int request_counter;
+    uint32_t events;
+    char in[CLIENT_IN_SIZE];
+    int in_len;
+    send_queue_t out;
+    int write_blocked;
+    // io_uring requests which may still complete for this slot.
+    int inflight;
+    // A multishot receive is armed.
+    int receiving;
+    long dropped;
+    // Token bucket of --rate, in millionths of a message, refilled when it is looked at.
+    int64_t tokens;
+    int64_t refilled_at;
+    long rate_dropped;
+    // Not read until resume_at, see server_hold.
+    int held;
+    uint64_t held_pass;
+    int64_t resume_at;
+    int pending_flush;
+    struct client_t *prev;
+    struct client_t *next;
+    struct client_t *flush_prev;
+    struct client_t *flush_next;
+    struct client_t *held_prev;
+    struct client_t *held_next;
+    struct room_t *room;
+    struct client_t *room_prev;
+    struct client_t *room_next;
+    struct client_t *index_next;
+} client_t;
+
+/*
+ * Clients live in chunks which never move, so pointers in epoll events stay
+ * valid. A released slot is reused only after client_slab_recycle.
+ */
+typedef struct client_slab_t
+{
+    client_t **chunks;
+    int chunk_count;
+    int chunk_capacity;
+    client_t *free_list;
+    client_t *released;
+    client_t *live;
+    int count;
+    int max_count;
+} client_slab_t;
+
+/*
+ * Active clients by name, for direct messages. Names are not unique,
+ * clients with the same name share a bucket chain and all of them are found.
+ * The bucket array doubles once there are more clients than buckets.
+ */
+typedef struct client_index_t
+{
+    client_t **buckets;
+    int bucket_count;
+    int count;
+    // The number of clients hashing to each slot, read by other shards like room_table_t.presence.
+    atomic_uint presence[CLIENT_INDEX_PRESENCE_SLOTS];
+} client_index_t;
+
+uint32_t name_hash(const char *name);
+
+void client_reset(client_t *client);
+
+void client_slab_init(client_slab_t *slab, int max_count);
+
+client_t *client_slab_alloc(client_slab_t *slab);
+
+void client_slab_free(client_slab_t *slab, client_t *client);
+
+void client_slab_recycle(client_slab_t *slab);
+
+void client_slab_destroy(client_slab_t *slab);
+
+void client_index_init(client_index_t *index);
+
+void client_index_add(client_index_t *index, client_t *client);
+
+void client_index_remove(client_index_t *index, client_t *client);
+
+client_t *client_index_find(client_index_t *index, const char *name);
+
+int client_index_maybe_present(client_index_t *index, uint32_t hash);
+
+client_t *client_index_next(client_t *client);
+
+void client_index_destroy(client_index_t *index);
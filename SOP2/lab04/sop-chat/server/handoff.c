@@ -0,0 +1,102 @@
+#include "handoff.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int handoff_socket(const char *path, struct sockaddr_un *addr)
+{
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        ERR("socket");
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return fd;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = handoff_socket(path, &addr);
+    if (unlink(path) < 0 && errno != ENOENT)
+        ERR("unlink");
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ERR("bind");
+    if (listen(fd, 1) < 0)
+        ERR("listen");
+    return fd;
+}
+
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = handoff_socket(path, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ERR("connect");
+    return fd;
+}
+
+int handoff_send(int socket, const handoff_record_t *record, int fd)
+{
+    struct iovec iov = {.iov_base = (void *)record, .iov_len = offsetof(handoff_record_t, in) + record->in_len};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (fd != -1)
+    {
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    if (TEMP_FAILURE_RETRY(sendmsg(socket, &message, MSG_NOSIGNAL)) < 0)
+        return -1;
+    return 0;
+}
+
+int handoff_receive(int socket, handoff_record_t *record, int *fd)
+{
+    struct iovec iov = {.iov_base = record, .iov_len = sizeof(*record)};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    *fd = -1;
+    ssize_t size = TEMP_FAILURE_RETRY(recvmsg(socket, &message, MSG_CMSG_CLOEXEC));
+    if (size <= 0)
+        return (int)size;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(header), sizeof(int));
+    if ((size_t)size < offsetof(handoff_record_t, in) || record->in_len > CLIENT_IN_SIZE ||
+        (size_t)size != offsetof(handoff_record_t, in) + record->in_len || (message.msg_flags & MSG_CTRUNC))
+    {
+        if (*fd != -1 && TEMP_FAILURE_RETRY(close(*fd)) < 0)
+            ERR("close");
+        *fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+    record->name[NAME_SIZE - 1] = '\0';
+    record->room[NAME_SIZE - 1] = '\0';
+    return 1;
+}
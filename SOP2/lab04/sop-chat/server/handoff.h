@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "client.h"
+
+/*
+ * Restart handoff
+ *
+ * A running server offers its sockets on a SOCK_SEQPACKET Unix socket. Its
+ * successor connects, sends HANDOFF_REQUEST and gets one record per message:
+ * - HANDOFF_LISTENER with one of the listening sockets, one per shard,
+ * - HANDOFF_LOCAL_LISTENER with the Unix listening socket, if there is one,
+ * - HANDOFF_CLIENT with the socket of an authorized client, its name, id,
+ *   room and whatever it sent that was not a whole message yet,
+ * - HANDOFF_END with the next free client id, after everything else.
+ * The successor sends HANDOFF_END back once it has it all, the predecessor
+ * keeps accepting until then. Descriptors travel as SCM_RIGHTS, the
+ * predecessor closes its copies.
+ */
+#define HANDOFF_REQUEST 1
+#define HANDOFF_LISTENER 2
+#define HANDOFF_CLIENT 3
+#define HANDOFF_END 4
+#define HANDOFF_LOCAL_LISTENER 5
+
+typedef struct handoff_record_t
+{
+    uint32_t type;
+    // HANDOFF_REQUEST: whether clients are wanted, HANDOFF_CLIENT: framed protocol,
+    // HANDOFF_END: whether clients were handed over.
+    uint32_t flags;
+    // HANDOFF_CLIENT: client id, HANDOFF_END: the next free id.
+    uint32_t id;
+    uint32_t in_len;
+    char name[NAME_SIZE];
+    char room[NAME_SIZE];
+    // Only in_len bytes are sent.
+    char in[CLIENT_IN_SIZE];
+} handoff_record_t;
+
+int handoff_listen(const char *path);
+
+int handoff_connect(const char *path);
+
+// Sends the record together with fd, unless it is -1. Returns -1 and sets errno on failure.
+int handoff_send(int socket, const handoff_record_t *record, int fd);
+
+/*
+ * Receives one record and the descriptor that came with it into fd, or -1.
+ * Returns 1, 0 at the end of the connection, or -1 with errno set on failure
+ * (EPROTO for a malformed record).
+ */
+int handoff_receive(int socket, handoff_record_t *record, int *fd);
@@ -0,0 +1,171 @@
+#include "history.h"
+
+#include <string.h>
+
+#include "client.h"
+
+void history_init(history_t *history, int capacity, int max_rooms)
+{
+    history->capacity = capacity;
+    atomic_init(&history->sequence, 0);
+    // The number of rooms is bounded, the tables never have to grow. All of them are one allocation.
+    int stripe_rooms = (max_rooms + HISTORY_STRIPES - 1) / HISTORY_STRIPES;
+    for (history->bucket_count = 1; history->bucket_count < stripe_rooms; history->bucket_count *= 2)
+        ;
+    if ((history->buckets = calloc(HISTORY_STRIPES * history->bucket_count, sizeof(history_room_t *))) == NULL)
+        ERR("calloc");
+    for (int i = 0; i < HISTORY_STRIPES; i++)
+    {
+        history_stripe_t *stripe = &history->stripes[i];
+        if (pthread_mutex_init(&stripe->mutex, NULL))
+            ERR("pthread_mutex_init");
+        stripe->buckets = history->buckets + i * history->bucket_count;
+        stripe->max_rooms = stripe_rooms;
+        stripe->count = 0;
+        stripe->lru_head = NULL;
+        stripe->lru_tail = NULL;
+    }
+}
+
+// The low bits of the hash pick the stripe, the rest the bucket in it.
+static history_stripe_t *history_stripe(history_t *history, const char *name)
+{
+    return &history->stripes[name_hash(name) & (HISTORY_STRIPES - 1)];
+}
+
+static history_room_t **history_link(history_t *history, history_stripe_t *stripe, const char *name)
+{
+    history_room_t **link = &stripe->buckets[(name_hash(name) / HISTORY_STRIPES) & (history->bucket_count - 1)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0)
+        link = &(*link)->next;
+    return link;
+}
+
+static void history_lru_unlink(history_stripe_t *stripe, history_room_t *room)
+{
+    if (room->lru_prev != NULL)
+        room->lru_prev->lru_next = room->lru_next;
+    else
+        stripe->lru_head = room->lru_next;
+    if (room->lru_next != NULL)
+        room->lru_next->lru_prev = room->lru_prev;
+    else
+        stripe->lru_tail = room->lru_prev;
+}
+
+static void history_lru_push(history_stripe_t *stripe, history_room_t *room)
+{
+    room->lru_prev = NULL;
+    room->lru_next = stripe->lru_head;
+    if (stripe->lru_head != NULL)
+        stripe->lru_head->lru_prev = room;
+    else
+        stripe->lru_tail = room;
+    stripe->lru_head = room;
+}
+
+static void history_room_free(history_t *history, history_room_t *room)
+{
+    for (int i = 0; i < room->count; i++)
+        relay_release(&room->ring[(room->head + i) % history->capacity]);
+    free(room->ring);
+    free(room);
+}
+
+static void history_evict(history_t *history, history_stripe_t *stripe)
+{
+    history_room_t *room = stripe->lru_tail;
+    history_lru_unlink(stripe, room);
+    *history_link(history, stripe, room->name) = room->next;
+    stripe->count--;
+    history_room_free(history, room);
+}
+
+/*
+ * Numbers the relay and keeps a reference to it in the room's history.
+ * Without a history the number is all there is to do, and takes no lock.
+ */
+void history_record(history_t *history, const char *name, relay_t *relay)
+{
+    if (history->capacity == 0)
+    {
+        relay_set_sequence(relay, atomic_fetch_add_explicit(&history->sequence, 1, memory_order_relaxed) + 1);
+        return;
+    }
+
+    history_stripe_t *stripe = history_stripe(history, name);
+    pthread_mutex_lock(&stripe->mutex);
+    relay_set_sequence(relay, atomic_fetch_add_explicit(&history->sequence, 1, memory_order_relaxed) + 1);
+    history_room_t **link = history_link(history, stripe, name);
+    history_room_t *room = *link;
+    if (room == NULL)
+    {
+        if (stripe->count >= stripe->max_rooms)
+        {
+            history_evict(history, stripe);
+            link = history_link(history, stripe, name);
+        }
+        if ((room = malloc(sizeof(history_room_t))) == NULL)
+            ERR("malloc");
+        if ((room->ring = malloc(history->capacity * sizeof(relay_t))) == NULL)
+            ERR("malloc");
+        memset(room->name, 0, NAME_SIZE);
+        strncpy(room->name, name, NAME_SIZE - 1);
+        room->head = 0;
+        room->count = 0;
+        room->next = NULL;
+        *link = room;
+        stripe->count++;
+    }
+    else
+        history_lru_unlink(stripe, room);
+    history_lru_push(stripe, room);
+
+    if (room->count == history->capacity)
+    {
+        relay_release(&room->ring[room->head]);
+        room->head = (room->head + 1) % history->capacity;
+        room->count--;
+    }
+    room->ring[(room->head + room->count++) % history->capacity] = relay_ref(relay);
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+/*
+ * Copies references to the room's messages numbered after the given one
+ * into relays, which has room for the history capacity, oldest first.
+ * Returns the number of messages copied.
+ */
+int history_since(history_t *history, const char *name, uint32_t sequence, relay_t *relays)
+{
+    if (history->capacity == 0)
+        return 0;
+    int count = 0;
+    history_stripe_t *stripe = history_stripe(history, name);
+    pthread_mutex_lock(&stripe->mutex);
+    history_room_t *room = *history_link(history, stripe, name);
+    if (room != NULL)
+    {
+        // Sequence numbers are global, the ones of a single room are increasing but not consecutive.
+        for (int i = 0; i < room->count; i++)
+        {
+            relay_t *relay = &room->ring[(room->head + i) % history->capacity];
+            if (relay->sequence > sequence)
+                relays[count++] = relay_ref(relay);
+        }
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return count;
+}
+
+void history_destroy(history_t *history)
+{
+    for (int i = 0; i < HISTORY_STRIPES; i++)
+    {
+        history_stripe_t *stripe = &history->stripes[i];
+        while (stripe->lru_tail != NULL)
+            history_evict(history, stripe);
+        pthread_mutex_destroy(&stripe->mutex);
+    }
+    free(history->buckets);
+}
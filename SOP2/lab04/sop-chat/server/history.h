@@ -0,0 +1,63 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "message.h"
+
+/*
+ * Recent messages of one room, oldest first in a ring of the history capacity.
+ * Histories are ordered from the most to the least recently written one,
+ * the last is evicted when there are too many rooms.
+ */
+typedef struct history_room_t
+{
+    char name[NAME_SIZE];
+    relay_t *ring;
+    int head;
+    int count;
+    struct history_room_t *next;
+    struct history_room_t *lru_prev;
+    struct history_room_t *lru_next;
+} history_room_t;
+
+// Rooms are spread over stripes by name, each with its own lock, so unrelated rooms rarely contend.
+#define HISTORY_STRIPES 16
+
+/*
+ * The histories of the rooms hashed to one stripe, with their own table and
+ * LRU order. The room limit is split evenly between the stripes.
+ */
+typedef struct history_stripe_t
+{
+    pthread_mutex_t mutex;
+    history_room_t **buckets;
+    int count;
+    int max_rooms;
+    history_room_t *lru_head;
+    history_room_t *lru_tail;
+} history_stripe_t;
+
+/*
+ * Recent room messages shared by all shards. Sequence numbers are global and
+ * never reused, a room's number is taken under its stripe's lock.
+ */
+typedef struct history_t
+{
+    int capacity;
+    atomic_uint sequence;
+    // The buckets of every stripe, bucket_count each.
+    history_room_t **buckets;
+    int bucket_count;
+    history_stripe_t stripes[HISTORY_STRIPES];
+} history_t;
+
+void history_init(history_t *history, int capacity, int max_rooms);
+
+void history_record(history_t *history, const char *room, relay_t *relay);
+
+int history_since(history_t *history, const char *room, uint32_t sequence, relay_t *relays);
+
+void history_destroy(history_t *history);
@@ -0,0 +1,227 @@
+#include "keys.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <sys/random.h>
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+    do                           \
+    {                            \
+        v0 += v1;                \
+        v1 = ROTL(v1, 13);       \
+        v1 ^= v0;                \
+        v0 = ROTL(v0, 32);       \
+        v2 += v3;                \
+        v3 = ROTL(v3, 16);       \
+        v3 ^= v2;                \
+        v0 += v3;                \
+        v3 = ROTL(v3, 21);       \
+        v3 ^= v0;                \
+        v2 += v1;                \
+        v1 = ROTL(v1, 17);       \
+        v1 ^= v2;                \
+        v2 = ROTL(v2, 32);       \
+    } while (0)
+
+// SipHash-2-4 of a padded key, whose length is a multiple of 8.
+static uint64_t key_digest(const uint64_t secret[2], const unsigned char *key)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ secret[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ secret[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ secret[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ secret[1];
+
+    for (int i = 0; i < KEY_SIZE; i += 8)
+    {
+        uint64_t m;
+        memcpy(&m, key + i, sizeof(m));
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)KEY_SIZE << 56;
+    v3 ^= last;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Looks at every byte no matter where the first difference is.
+static int key_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char difference = 0;
+    for (int i = 0; i < KEY_SIZE; i++)
+        difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+// Returns -1 if the key is too long.
+static int key_pad(unsigned char *padded, const char *key)
+{
+    size_t length = strnlen(key, KEY_SIZE);
+    if (length == KEY_SIZE)
+        return -1;
+    memset(padded, 0, KEY_SIZE);
+    memcpy(padded, key, length);
+    return 0;
+}
+
+static key_entry_t **key_bucket(const key_table_t *table, uint64_t digest)
+{
+    return &table->buckets[digest & (table->bucket_count - 1)];
+}
+
+const key_entry_t *key_table_find(const key_table_t *table, const char *key)
+{
+    unsigned char padded[KEY_SIZE];
+    if (key_pad(padded, key) < 0)
+        return NULL;
+
+    uint64_t digest = key_digest(table->secret, padded);
+    const key_entry_t *found = NULL;
+    for (const key_entry_t *entry = *key_bucket(table, digest); entry != NULL; entry = entry->next)
+    {
+        if (entry->digest == digest && key_equal(entry->key, padded) && found == NULL)
+            found = entry;
+    }
+    return found;
+}
+
+key_table_t *key_table_create(int capacity)
+{
+    key_table_t *table = calloc(1, sizeof(key_table_t));
+    if (table == NULL)
+        ERR("calloc");
+    if (getrandom(table->secret, sizeof(table->secret), 0) != sizeof(table->secret))
+        ERR("getrandom");
+    table->capacity = capacity;
+    table->bucket_count = 1;
+    while (table->bucket_count < 2 * capacity)
+        table->bucket_count *= 2;
+    if ((table->buckets = calloc(table->bucket_count, sizeof(key_entry_t *))) == NULL)
+        ERR("calloc");
+    if ((table->entries = malloc(capacity * sizeof(key_entry_t))) == NULL)
+        ERR("malloc");
+    return table;
+}
+
+int key_table_add(key_table_t *table, const char *tenant, const char *key, char *error, size_t error_size)
+{
+    if (strlen(tenant) >= NAME_SIZE)
+    {
+        snprintf(error, error_size, "tenant name longer than %d characters", NAME_SIZE - 1);
+        return -1;
+    }
+    if (table->count == table->capacity)
+    {
+        snprintf(error, error_size, "more than %d keys", table->capacity);
+        return -1;
+    }
+
+    key_entry_t *entry = &table->entries[table->count];
+    if (key_pad(entry->key, key) < 0)
+    {
+        snprintf(error, error_size, "key longer than %d characters", KEY_SIZE - 1);
+        return -1;
+    }
+    if (key_table_find(table, key) != NULL)
+    {
+        snprintf(error, error_size, "repeated key");
+        return -1;
+    }
+    memset(entry->tenant, 0, NAME_SIZE);
+    strcpy(entry->tenant, tenant);
+    entry->digest = key_digest(table->secret, entry->key);
+    key_entry_t **bucket = key_bucket(table, entry->digest);
+    entry->next = *bucket;
+    *bucket = entry;
+    table->count++;
+    return 0;
+}
+
+static int key_table_parse(key_table_t *table, FILE *file, char *error, size_t error_size)
+{
+    char line[2 * KEY_SIZE + NAME_SIZE];
+    char reason[64];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n')
+        {
+            snprintf(error, error_size, "line %d is too long", number);
+            return -1;
+        }
+        char *tenant = line;
+        while (isspace((unsigned char)*tenant))
+            tenant++;
+        if (*tenant == '\0' || *tenant == '#')
+            continue;
+
+        char *saveptr;
+        tenant = strtok_r(tenant, " \t\r\n", &saveptr);
+        char *key = strtok_r(NULL, " \t\r\n", &saveptr);
+        if (key == NULL || strtok_r(NULL, " \t\r\n", &saveptr) != NULL)
+        {
+            snprintf(error, error_size, "line %d is not \"tenant key\"", number);
+            return -1;
+        }
+        if (key_table_add(table, tenant, key, reason, sizeof(reason)) < 0)
+        {
+            snprintf(error, error_size, "line %d: %s", number, reason);
+            return -1;
+        }
+    }
+    if (ferror(file))
+    {
+        snprintf(error, error_size, "%s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The file is read twice: the first pass counts the lines, which bounds
+ * the number of keys, so the table is sized once and never grows.
+ */
+key_table_t *key_table_load(const char *path, char *error, size_t error_size)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        snprintf(error, error_size, "%s", strerror(errno));
+        return NULL;
+    }
+    int capacity = 1;
+    for (int c; (c = fgetc(file)) != EOF;)
+        capacity += c == '\n';
+    rewind(file);
+
+    key_table_t *table = key_table_create(capacity);
+    int ret = key_table_parse(table, file, error, error_size);
+    if (fclose(file))
+        ERR("fclose");
+    if (ret < 0)
+    {
+        key_table_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void key_table_free(key_table_t *table)
+{
+    if (table == NULL)
+        return;
+    free(table->buckets);
+    free(table->entries);
+    free(table);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+// The whole zero-padded key field of the handshake frame, the digest needs a multiple of 8.
+#define KEY_SIZE MESSAGE_SIZE
+
+typedef struct key_entry_t
+{
+    uint64_t digest;
+    unsigned char key[KEY_SIZE];
+    char tenant[NAME_SIZE];
+    struct key_entry_t *next;
+} key_entry_t;
+
+/*
+ * Keys of every tenant by a keyed SipHash-2-4 digest, compared in constant
+ * time. A table is never modified once in use, a reload builds a new one.
+ */
+typedef struct key_table_t
+{
+    uint64_t secret[2];
+    key_entry_t *entries;
+    key_entry_t **buckets;
+    int bucket_count;
+    int count;
+    int capacity;
+} key_table_t;
+
+key_table_t *key_table_create(int capacity);
+
+// Returns -1 and describes the problem in error if the key cannot be added.
+int key_table_add(key_table_t *table, const char *tenant, const char *key, char *error, size_t error_size);
+
+// One "tenant key" pair per line, # starts a comment. Returns NULL and describes the problem in error.
+key_table_t *key_table_load(const char *path, char *error, size_t error_size);
+
+void key_table_free(key_table_t *table);
+
+// Returns the entry of the NUL-terminated key or NULL.
+const key_entry_t *key_table_find(const key_table_t *table, const char *key);
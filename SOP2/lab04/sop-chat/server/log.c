@@ -0,0 +1,302 @@
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Per-thread token bucket, so shards never contend on the limiter.
+ */
+typedef struct log_limiter_t
+{
+    double tokens;
+    struct timespec last;
+    long suppressed;
+} log_limiter_t;
+
+static log_t logger = {.fd = STDERR_FILENO, .level = LOG_MESSAGE};
+static _Thread_local log_limiter_t limiter;
+
+static const char *level_names[] = {"error", "warning", "info", "message"};
+
+static void *log_thread(void *arg);
+
+static void log_wakeup(void)
+{
+    uint64_t value = 1;
+    if (TEMP_FAILURE_RETRY(write(logger.event_fd, &value, sizeof(value))) < 0)
+        ERR("write");
+}
+
+int log_parse_level(const char *name, log_level_t *level)
+{
+    for (int i = LOG_ERROR; i <= LOG_MESSAGE; i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+        {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void log_start(const char *path, log_level_t level, int rate)
+{
+    logger.level = level;
+    logger.rate = rate;
+    logger.fd = STDERR_FILENO;
+    if (path != NULL && (logger.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        ERR("open");
+
+    if ((logger.ring = malloc(LOG_RING_SIZE * sizeof(log_record_t))) == NULL)
+        ERR("malloc");
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&logger.ring[i].sequence, i);
+    atomic_init(&logger.tail, 0);
+    logger.head = 0;
+    atomic_init(&logger.lost, 0);
+    if ((logger.event_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        ERR("eventfd");
+    atomic_init(&logger.sleeping, 0);
+    atomic_init(&logger.running, 1);
+    if (pthread_create(&logger.tid, NULL, log_thread, NULL))
+        ERR("pthread_create");
+}
+
+/*
+ * Every thread which logs must be done with it, the records still in the ring are written out.
+ */
+void log_stop(void)
+{
+    atomic_store(&logger.running, 0);
+    log_wakeup();
+    if (pthread_join(logger.tid, NULL))
+        ERR("pthread_join");
+    if (TEMP_FAILURE_RETRY(close(logger.event_fd)) < 0)
+        ERR("close");
+    free(logger.ring);
+    logger.ring = NULL;
+    if (logger.fd != STDERR_FILENO && TEMP_FAILURE_RETRY(close(logger.fd)) < 0)
+        ERR("close");
+    logger.fd = STDERR_FILENO;
+}
+
+int log_enabled(log_level_t level)
+{
+    return level <= logger.level;
+}
+
+static int log_limit(log_level_t level, const struct timespec *now)
+{
+    if (logger.rate == 0 || level < LOG_INFO)
+        return 0;
+
+    double elapsed = (now->tv_sec - limiter.last.tv_sec) + (now->tv_nsec - limiter.last.tv_nsec) / 1e9;
+    limiter.last = *now;
+    limiter.tokens += elapsed * logger.rate;
+    if (limiter.tokens > logger.rate)
+        limiter.tokens = logger.rate;
+    if (limiter.tokens < 1)
+    {
+        limiter.suppressed++;
+        return 1;
+    }
+    limiter.tokens--;
+    return 0;
+}
+
+/*
+ * Returns a free slot or NULL when the record is filtered out or the ring is full.
+ * The slot belongs to the caller until log_commit.
+ */
+static log_record_t *log_claim(log_level_t level)
+{
+    if (!log_enabled(level) || logger.ring == NULL)
+        return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (log_limit(level, &now))
+        return NULL;
+
+    size_t position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+    log_record_t *record;
+    for (;;)
+    {
+        record = &logger.ring[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&logger.tail, &position, position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            atomic_fetch_add_explicit(&logger.lost, 1, memory_order_relaxed);
+            return NULL;
+        }
+        else
+            position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+    }
+
+    record->level = level;
+    record->suppressed = limiter.suppressed;
+    limiter.suppressed = 0;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    return record;
+}
+
+static void log_commit(log_record_t *record)
+{
+    size_t position = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+    // Pairs with the fence of log_thread: either it sees the record or this sees it asleep.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&logger.sleeping, memory_order_relaxed) && atomic_exchange(&logger.sleeping, 0))
+        log_wakeup();
+}
+
+static int log_ready(void)
+{
+    log_record_t *record = &logger.ring[logger.head & (LOG_RING_SIZE - 1)];
+    return atomic_load_explicit(&record->sequence, memory_order_acquire) == logger.head + 1;
+}
+
+void log_write(log_level_t level, const char *format, ...)
+{
+    log_record_t *record = log_claim(level);
+    if (record == NULL)
+        return;
+
+    va_list arguments;
+    va_start(arguments, format);
+    int size = vsnprintf(record->text, MESSAGE_SIZE, format, arguments);
+    va_end(arguments);
+    record->from[0] = '\0';
+    record->size = size < 0 ? 0 : size >= MESSAGE_SIZE ? MESSAGE_SIZE - 1 : size;
+    log_commit(record);
+}
+
+void log_message(const char *from, const char *to, int direct, const char *text, size_t size)
+{
+    log_record_t *record = log_claim(LOG_MESSAGE);
+    if (record == NULL)
+        return;
+
+    strncpy(record->from, from, NAME_SIZE - 1);
+    record->from[NAME_SIZE - 1] = '\0';
+    strncpy(record->to, to, NAME_SIZE - 1);
+    record->to[NAME_SIZE - 1] = '\0';
+    record->direct = direct;
+    record->size = size > MESSAGE_SIZE ? MESSAGE_SIZE : (int)size;
+    memcpy(record->text, text, record->size);
+    log_commit(record);
+}
+
+static void log_flush(char *buffer, size_t *length)
+{
+    size_t offset = 0;
+    while (offset < *length)
+    {
+        ssize_t count = TEMP_FAILURE_RETRY(write(logger.fd, buffer + offset, *length - offset));
+        // There is nowhere to report a failing log, the batch is dropped.
+        if (count <= 0)
+            break;
+        offset += count;
+    }
+    *length = 0;
+}
+
+static void log_append(char *buffer, size_t *length, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void log_append(char *buffer, size_t *length, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    int size = vsnprintf(buffer + *length, LOG_BATCH_SIZE - *length, format, arguments);
+    va_end(arguments);
+    if (size > 0)
+        *length += (size_t)size < LOG_BATCH_SIZE - *length ? (size_t)size : LOG_BATCH_SIZE - *length - 1;
+}
+
+static void log_format(log_record_t *record, char *buffer, size_t *length)
+{
+    // The time of day only changes once a second, cache it.
+    static time_t last_second = -1;
+    static char clock[16];
+    if (record->time.tv_sec != last_second)
+    {
+        struct tm tm;
+        localtime_r(&record->time.tv_sec, &tm);
+        strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+        last_second = record->time.tv_sec;
+    }
+
+    if (record->suppressed > 0)
+        log_append(buffer, length, "%s.%03ld [warning] %ld records suppressed by the rate limit\n", clock,
+                   record->time.tv_nsec / 1000000, record->suppressed);
+    log_append(buffer, length, "%s.%03ld [%s] ", clock, record->time.tv_nsec / 1000000, level_names[record->level]);
+    if (record->from[0] == '\0')
+        log_append(buffer, length, "%.*s\n", record->size, record->text);
+    else if (record->direct)
+        log_append(buffer, length, "%s -> %s: %.*s\n", record->from, record->to, record->size, record->text);
+    else
+        log_append(buffer, length, "%s@%s: %.*s\n", record->from, record->to, record->size, record->text);
+}
+
+// Drains the ring into one buffer and writes it with as few calls as possible.
+static void *log_thread(void *arg)
+{
+    UNUSED(arg);
+    char *buffer = malloc(LOG_BATCH_SIZE);
+    if (buffer == NULL)
+        ERR("malloc");
+    size_t length = 0;
+    long lost = 0;
+
+    for (;;)
+    {
+        int running = atomic_load(&logger.running);
+        int drained = 0;
+        while (log_ready())
+        {
+            log_record_t *record = &logger.ring[logger.head & (LOG_RING_SIZE - 1)];
+            // A record never takes more than a quarter of the batch.
+            if (LOG_BATCH_SIZE - length < 4 * BUFF_SIZE)
+                log_flush(buffer, &length);
+            log_format(record, buffer, &length);
+            atomic_store_explicit(&record->sequence, logger.head + LOG_RING_SIZE, memory_order_release);
+            logger.head++;
+            drained++;
+        }
+
+        long total_lost = atomic_load_explicit(&logger.lost, memory_order_relaxed);
+        if (total_lost > lost)
+        {
+            log_append(buffer, &length, "[warning] %ld records lost, the log ring was full\n", total_lost - lost);
+            lost = total_lost;
+        }
+        if (length > 0)
+            log_flush(buffer, &length);
+        if (!running)
+            break;
+        if (drained > 0)
+            continue;
+        atomic_store_explicit(&logger.sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t value;
+        if (!log_ready() && atomic_load(&logger.running) &&
+            TEMP_FAILURE_RETRY(read(logger.event_fd, &value, sizeof(value))) < 0)
+            ERR("read");
+        atomic_store(&logger.sleeping, 0);
+    }
+
+    free(buffer);
+    return NULL;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "chat.h"
+
+#define LOG_RING_SIZE 4096
+#define LOG_BATCH_SIZE (64 * 1024)
+
+/*
+ * Every level includes the ones above it, LOG_MESSAGE is the audit trail of relayed messages.
+ */
+typedef enum log_level_t
+{
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_MESSAGE,
+} log_level_t;
+
+/*
+ * A record is either a line of text (from is empty) or a relayed message,
+ * which is copied as it is and only formatted by the logging thread.
+ */
+typedef struct log_record_t
+{
+    atomic_size_t sequence;
+    log_level_t level;
+    int direct;
+    long suppressed;
+    struct timespec time;
+    char from[NAME_SIZE];
+    char to[NAME_SIZE];
+    int size;
+    char text[MESSAGE_SIZE];
+} log_record_t;
+
+/*
+ * Lock-free ring (D. Vyukov) drained by the logging thread. Producers never
+ * wait, a record which finds the ring full is counted as lost. The logging
+ * thread sleeps on event_fd while the ring is empty.
+ */
+typedef struct log_t
+{
+    log_record_t *ring;
+    atomic_size_t tail;
+    size_t head;
+    atomic_long lost;
+    log_level_t level;
+    // Records per second per thread at LOG_INFO and below, 0 means no limit.
+    int rate;
+    int fd;
+    int event_fd;
+    atomic_int sleeping;
+    atomic_int running;
+    pthread_t tid;
+} log_t;
+
+// path == NULL logs to stderr.
+void log_start(const char *path, log_level_t level, int rate);
+
+void log_stop(void);
+
+int log_enabled(log_level_t level);
+
+void log_write(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void log_message(const char *from, const char *to, int direct, const char *text, size_t size);
+
+int log_parse_level(const char *name, log_level_t *level);
@@ -0,0 +1,182 @@
+#include "message.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "chat.h"
+
+message_t *message_new(const char *data, size_t size)
+{
+    message_t *message = malloc(sizeof(message_t) + size);
+    if (message == NULL)
+        ERR("malloc");
+    atomic_init(&message->refcount, 1);
+    message->size = size;
+    memcpy(message->data, data, size);
+    return message;
+}
+
+message_t *message_new_frame(uint8_t type, uint32_t id, const char *payload, size_t size)
+{
+    size_t length = FRAME_ID_SIZE + size;
+    message_t *message = malloc(sizeof(message_t) + FRAME_HEADER_SIZE + length);
+    if (message == NULL)
+        ERR("malloc");
+    atomic_init(&message->refcount, 1);
+    message->size = FRAME_HEADER_SIZE + length;
+
+    uint16_t net_length = htons((uint16_t)length);
+    uint32_t net_id = htonl(id);
+    memcpy(message->data, &net_length, sizeof(net_length));
+    message->data[2] = (char)type;
+    memcpy(message->data + FRAME_HEADER_SIZE, &net_id, FRAME_ID_SIZE);
+    memcpy(message->data + FRAME_HEADER_SIZE + FRAME_ID_SIZE, payload, size);
+    return message;
+}
+
+message_t *message_new_legacy(const char *name, const char *text, size_t size)
+{
+    message_t *message = malloc(sizeof(message_t) + BUFF_SIZE);
+    if (message == NULL)
+        ERR("malloc");
+    atomic_init(&message->refcount, 1);
+    message->size = BUFF_SIZE;
+    memset(message->data, 0, BUFF_SIZE);
+    strncpy(message->data + NAME_OFFSET, name, NAME_SIZE - 1);
+    memcpy(message->data + MESSAGE_OFFSET, text, size < MESSAGE_SIZE ? size : MESSAGE_SIZE - 1);
+    return message;
+}
+
+message_t *message_ref(message_t *message)
+{
+    atomic_fetch_add_explicit(&message->refcount, 1, memory_order_relaxed);
+    return message;
+}
+
+void message_unref(message_t *message)
+{
+    if (atomic_fetch_sub_explicit(&message->refcount, 1, memory_order_acq_rel) == 1)
+        free(message);
+}
+
+/*
+ * Builds both encodings of a message once, the recipients only take references.
+ */
+void relay_init(relay_t *relay, uint32_t sender_id, message_t *name, const char *sender, const char *text, size_t size)
+{
+    char payload[FRAME_SEQUENCE_SIZE + MESSAGE_SIZE];
+    memset(payload, 0, FRAME_SEQUENCE_SIZE);
+    memcpy(payload + FRAME_SEQUENCE_SIZE, text, size);
+
+    relay->sender_id = sender_id;
+    relay->sequence = 0;
+    relay->legacy = message_new_legacy(sender, text, size);
+    relay->framed = message_new_frame(FRAME_MESSAGE, sender_id, payload, FRAME_SEQUENCE_SIZE + size);
+    relay->name = message_ref(name);
+}
+
+/*
+ * Numbers a relay which has not been shared with anyone yet.
+ */
+void relay_set_sequence(relay_t *relay, uint32_t sequence)
+{
+    uint32_t net_sequence = htonl(sequence);
+    relay->sequence = sequence;
+    memcpy(relay->framed->data + FRAME_HEADER_SIZE + FRAME_ID_SIZE, &net_sequence, FRAME_SEQUENCE_SIZE);
+}
+
+relay_t relay_ref(relay_t *relay)
+{
+    relay_t copy = *relay;
+    message_ref(copy.legacy);
+    message_ref(copy.framed);
+    message_ref(copy.name);
+    return copy;
+}
+
+void relay_release(relay_t *relay)
+{
+    message_unref(relay->legacy);
+    message_unref(relay->framed);
+    message_unref(relay->name);
+}
+
+void send_queue_init(send_queue_t *queue)
+{
+    queue->items = NULL;
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->count = 0;
+    queue->offset = 0;
+    queue->size = 0;
+}
+
+void send_queue_clear(send_queue_t *queue)
+{
+    for (int i = 0; i < queue->count; i++)
+        message_unref(queue->items[(queue->head + i) & (queue->capacity - 1)]);
+    free(queue->items);
+    send_queue_init(queue);
+}
+
+static void send_queue_grow(send_queue_t *queue)
+{
+    int capacity = queue->capacity ? 2 * queue->capacity : SEND_QUEUE_MIN_CAPACITY;
+    message_t **items = malloc(capacity * sizeof(message_t *));
+    if (items == NULL)
+        ERR("malloc");
+    for (int i = 0; i < queue->count; i++)
+        items[i] = queue->items[(queue->head + i) & (queue->capacity - 1)];
+    free(queue->items);
+    queue->items = items;
+    queue->capacity = capacity;
+    queue->head = 0;
+}
+
+void send_queue_push(send_queue_t *queue, message_t *message)
+{
+    if (queue->count == queue->capacity)
+        send_queue_grow(queue);
+    queue->items[(queue->head + queue->count) & (queue->capacity - 1)] = message_ref(message);
+    queue->count++;
+    queue->size += message->size;
+}
+
+int send_queue_peek(send_queue_t *queue, struct iovec *iov, int max_count)
+{
+    int count = queue->count < max_count ? queue->count : max_count;
+    for (int i = 0; i < count; i++)
+    {
+        message_t *message = queue->items[(queue->head + i) & (queue->capacity - 1)];
+        iov[i].iov_base = message->data;
+        iov[i].iov_len = message->size;
+    }
+    if (count > 0)
+    {
+        iov[0].iov_base = (char *)iov[0].iov_base + queue->offset;
+        iov[0].iov_len -= queue->offset;
+    }
+    return count;
+}
+
+/*
+ * Releases count written bytes from the front of the queue.
+ * Returns the number of messages which have been written completely.
+ */
+int send_queue_consume(send_queue_t *queue, size_t count)
+{
+    int done = 0;
+    queue->size -= count;
+    count += queue->offset;
+    while (queue->count > 0 && count >= queue->items[queue->head]->size)
+    {
+        message_t *message = queue->items[queue->head];
+        count -= message->size;
+        message_unref(message);
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        queue->count--;
+        done++;
+    }
+    queue->offset = count;
+    return done;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SEND_QUEUE_MIN_CAPACITY 16
+#define SEND_BATCH 64
+
+/*
+ * A message is written once and shared by reference between
+ * the send queues of all its recipients, on every shard. It is freed
+ * when the last queue holding it is done with it.
+ */
+typedef struct message_t
+{
+    atomic_int refcount;
+    size_t size;
+    char data[];
+} message_t;
+
+/*
+ * One chat message in every encoding a recipient may need: a legacy
+ * fixed-size frame and a FRAME_MESSAGE frame, plus the FRAME_NAME frame
+ * introducing its sender, which is shared by all messages of the session.
+ */
+typedef struct relay_t
+{
+    uint32_t sender_id;
+    uint32_t sequence;
+    message_t *legacy;
+    message_t *framed;
+    message_t *name;
+} relay_t;
+
+/*
+ * Queue of messages waiting to be written to a single client.
+ * offset is the part of the first message that has already been written,
+ * size is the number of bytes still to be written.
+ */
+typedef struct send_queue_t
+{
+    message_t **items;
+    int capacity;
+    int head;
+    int count;
+    size_t offset;
+    size_t size;
+} send_queue_t;
+
+message_t *message_new(const char *data, size_t size);
+
+message_t *message_new_frame(uint8_t type, uint32_t id, const char *payload, size_t size);
+
+message_t *message_new_legacy(const char *name, const char *text, size_t size);
+
+message_t *message_ref(message_t *message);
+
+void message_unref(message_t *message);
+
+void relay_init(relay_t *relay, uint32_t sender_id, message_t *name, const char *sender, const char *text, size_t size);
+
+void relay_set_sequence(relay_t *relay, uint32_t sequence);
+
+relay_t relay_ref(relay_t *relay);
+
+void relay_release(relay_t *relay);
+
+void send_queue_init(send_queue_t *queue);
+
+void send_queue_clear(send_queue_t *queue);
+
+void send_queue_push(send_queue_t *queue, message_t *message);
+
+int send_queue_peek(send_queue_t *queue, struct iovec *iov, int max_count);
+
+int send_queue_consume(send_queue_t *queue, size_t count);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdatomic.h>
+
+// Intrusive lock-free queue (D. Vyukov): any thread may push, only the owner pops.
+typedef struct mpsc_node_t
+{
+    _Atomic(struct mpsc_node_t *) next;
+} mpsc_node_t;
+
+typedef struct mpsc_queue_t
+{
+    _Atomic(mpsc_node_t *) head;
+    mpsc_node_t *tail;
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+void mpsc_init(mpsc_queue_t *queue);
+
+void mpsc_push(mpsc_queue_t *queue, mpsc_node_t *node);
+
+mpsc_node_t *mpsc_pop(mpsc_queue_t *queue);
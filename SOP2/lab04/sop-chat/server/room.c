@@ -0,0 +1,144 @@
+#include "room.h"
+
+#include <string.h>
+
+void room_table_init(room_table_t *table)
+{
+    table->bucket_count = ROOM_MIN_BUCKETS;
+    table->count = 0;
+    if ((table->buckets = calloc(table->bucket_count, sizeof(room_t *))) == NULL)
+        ERR("calloc");
+    for (int i = 0; i < ROOM_PRESENCE_SLOTS; i++)
+        atomic_store_explicit(&table->presence[i], 0, memory_order_relaxed);
+}
+
+// Pairs with the acquire load of room_maybe_present, a forward after the join sees the room.
+static void room_presence_add(room_table_t *table, const char *name, int delta)
+{
+    atomic_fetch_add_explicit(&table->presence[name_hash(name) & (ROOM_PRESENCE_SLOTS - 1)], delta,
+                              memory_order_release);
+}
+
+/*
+ * Whether a room with the given name hash may have members in the table,
+ * safe to call from any thread.
+ */
+int room_maybe_present(room_table_t *table, uint32_t hash)
+{
+    return atomic_load_explicit(&table->presence[hash & (ROOM_PRESENCE_SLOTS - 1)], memory_order_acquire) > 0;
+}
+
+static void room_table_grow(room_table_t *table)
+{
+    int bucket_count = 2 * table->bucket_count;
+    room_t **buckets = calloc(bucket_count, sizeof(room_t *));
+    if (buckets == NULL)
+        ERR("calloc");
+
+    for (int i = 0; i < table->bucket_count; i++)
+    {
+        room_t *next;
+        for (room_t *room = table->buckets[i]; room != NULL; room = next)
+        {
+            next = room->next;
+            room_t **bucket = &buckets[name_hash(room->name) & (bucket_count - 1)];
+            room->next = *bucket;
+            *bucket = room;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+room_t *room_find(room_table_t *table, const char *name)
+{
+    room_t *room = table->buckets[name_hash(name) & (table->bucket_count - 1)];
+    while (room != NULL && strcmp(room->name, name) != 0)
+        room = room->next;
+    return room;
+}
+
+/*
+ * Moves the client to the room, which is created on first join.
+ */
+void room_join(room_table_t *table, const char *name, client_t *client)
+{
+    room_t *room = room_find(table, name);
+    if (room == client->room && room != NULL)
+        return;
+    room_leave(table, client);
+
+    if (room == NULL)
+    {
+        if (table->count >= table->bucket_count)
+            room_table_grow(table);
+        if ((room = malloc(sizeof(room_t))) == NULL)
+            ERR("malloc");
+        memset(room->name, 0, NAME_SIZE);
+        strncpy(room->name, name, NAME_SIZE - 1);
+        room->members = NULL;
+        room->member_count = 0;
+
+        room_t **bucket = &table->buckets[name_hash(room->name) & (table->bucket_count - 1)];
+        room->next = *bucket;
+        *bucket = room;
+        table->count++;
+        room_presence_add(table, room->name, 1);
+    }
+
+    client->room = room;
+    client->room_prev = NULL;
+    client->room_next = room->members;
+    if (room->members != NULL)
+        room->members->room_prev = client;
+    room->members = client;
+    room->member_count++;
+}
+
+/*
+ * Removes the client from its room, if any. The last one out deletes the room.
+ */
+void room_leave(room_table_t *table, client_t *client)
+{
+    room_t *room = client->room;
+    if (room == NULL)
+        return;
+
+    if (client->room_prev != NULL)
+        client->room_prev->room_next = client->room_next;
+    else
+        room->members = client->room_next;
+    if (client->room_next != NULL)
+        client->room_next->room_prev = client->room_prev;
+    client->room = NULL;
+    client->room_prev = NULL;
+    client->room_next = NULL;
+
+    if (--room->member_count > 0)
+        return;
+    room_t **link = &table->buckets[name_hash(room->name) & (table->bucket_count - 1)];
+    while (*link != room)
+        link = &(*link)->next;
+    *link = room->next;
+    table->count--;
+    room_presence_add(table, room->name, -1);
+    free(room);
+}
+
+void room_table_destroy(room_table_t *table)
+{
+    for (int i = 0; i < table->bucket_count; i++)
+    {
+        room_t *next;
+        for (room_t *room = table->buckets[i]; room != NULL; room = next)
+        {
+            next = room->next;
+            free(room);
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->bucket_count = 0;
+    table->count = 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "chat.h"
+#include "client.h"
+
+#define ROOM_MIN_BUCKETS 64
+// Counters other shards read to see whether a room may have members here, a power of two.
+#define ROOM_PRESENCE_SLOTS 4096
+
+/*
+ * A named room and the clients which joined it, linked through
+ * client_t.room_prev and client_t.room_next, so a message sent to the
+ * room only touches its members. A room exists while it has members.
+ */
+typedef struct room_t
+{
+    char name[NAME_SIZE];
+    client_t *members;
+    int member_count;
+    struct room_t *next;
+} room_t;
+
+/*
+ * The rooms of one shard. presence counts its rooms per hash slot, other
+ * shards read it to skip a shard without the room.
+ */
+typedef struct room_table_t
+{
+    room_t **buckets;
+    int bucket_count;
+    int count;
+    atomic_uint presence[ROOM_PRESENCE_SLOTS];
+} room_table_t;
+
+void room_table_init(room_table_t *table);
+
+room_t *room_find(room_table_t *table, const char *name);
+
+int room_maybe_present(room_table_t *table, uint32_t hash);
+
+void room_join(room_table_t *table, const char *name, client_t *client);
+
+void room_leave(room_table_t *table, client_t *client);
+
+void room_table_destroy(room_table_t *table);
@@ -3,11 +3,14 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -38,6 +41,91 @@ int sethandler(void (*f)(int), int sigNo)
     return 0;
 }
 
+long raise_fd_limit(long needed)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    if (limit.rlim_cur >= (rlim_t)needed)
+        return needed;
+    limit.rlim_cur = limit.rlim_max < (rlim_t)needed ? limit.rlim_max : (rlim_t)needed;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+    return limit.rlim_cur;
+}
+
+/*
+ * TCP options of the listening socket, inherited by the accepted ones, zero
+ * keeps the kernel default. Times are in seconds, busy_poll in microseconds.
+ */
+typedef struct tcp_profile_t
+{
+    int nodelay;
+    int send_buffer;
+    int receive_buffer;
+    int defer_accept;
+    int keepalive_idle;
+    int keepalive_interval;
+    int keepalive_count;
+    int busy_poll;
+} tcp_profile_t;
+
+// none: kernel defaults, latency: small messages, throughput: bulk transfers.
+int tcp_profile_parse(const char *name, tcp_profile_t *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    if (strcmp(name, "none") == 0)
+        return 0;
+    profile->keepalive_idle = 60;
+    profile->keepalive_interval = 10;
+    profile->keepalive_count = 6;
+    if (strcmp(name, "latency") == 0)
+    {
+        profile->nodelay = 1;
+        return 0;
+    }
+    if (strcmp(name, "throughput") == 0)
+    {
+        profile->send_buffer = 1 << 20;
+        profile->receive_buffer = 1 << 20;
+        return 0;
+    }
+    return -1;
+}
+
+void set_socket_option(int fd, int level, int name, int value)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)))
+        ERR("setsockopt");
+}
+
+void apply_tcp_listener_profile(int fd, const tcp_profile_t *profile)
+{
+    if (profile->nodelay)
+        set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (profile->send_buffer > 0)
+        set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, profile->send_buffer);
+    if (profile->receive_buffer > 0)
+        set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, profile->receive_buffer);
+    if (profile->defer_accept > 0)
+        set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept);
+    if (profile->keepalive_idle > 0)
+    {
+        set_socket_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        set_socket_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, profile->keepalive_idle);
+        set_socket_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, profile->keepalive_interval);
+        set_socket_option(fd, IPPROTO_TCP, TCP_KEEPCNT, profile->keepalive_count);
+    }
+    // Above net.core.busy_read it needs CAP_NET_ADMIN, without it the option is skipped.
+    if (profile->busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll, sizeof(int)) &&
+        errno != EPERM)
+        ERR("setsockopt");
+}
+
+/*
+ * A name starting with '@' is in the abstract namespace: there is no file
+ * to create or remove, the name is gone together with the socket.
+ */
 int make_local_socket(char *name, struct sockaddr_un *addr)
 {
     int socketfd;
@@ -45,16 +133,27 @@ int make_local_socket(char *name, struct sockaddr_un *addr)
         ERR("socket");
     memset(addr, 0, sizeof(struct sockaddr_un));
     addr->sun_family = AF_UNIX;
-    strncpy(addr->sun_path, name, sizeof(addr->sun_path) - 1);
+    if (name[0] == '@')
+        strncpy(addr->sun_path + 1, name + 1, sizeof(addr->sun_path) - 2);
+    else
+        strncpy(addr->sun_path, name, sizeof(addr->sun_path) - 1);
     return socketfd;
 }
 
+// An abstract name is not NUL-terminated, the length tells where it ends.
+socklen_t local_address_length(struct sockaddr_un *addr)
+{
+    if (addr->sun_path[0] != '\0')
+        return SUN_LEN(addr);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
 int connect_local_socket(char *name)
 {
     struct sockaddr_un addr;
     int socketfd;
     socketfd = make_local_socket(name, &addr);
-    if (connect(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+    if (connect(socketfd, (struct sockaddr *)&addr, local_address_length(&addr)) < 0)
     {
         ERR("connect");
     }
@@ -65,10 +164,10 @@ int bind_local_socket(char *name, int backlog_size)
 {
     struct sockaddr_un addr;
     int socketfd;
-    if (unlink(name) < 0 && errno != ENOENT)
+    if (name[0] != '@' && unlink(name) < 0 && errno != ENOENT)
         ERR("unlink");
     socketfd = make_local_socket(name, &addr);
-    if (bind(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+    if (bind(socketfd, (struct sockaddr *)&addr, local_address_length(&addr)) < 0)
         ERR("bind");
     if (listen(socketfd, backlog_size) < 0)
         ERR("listen");
@@ -114,7 +213,7 @@ int connect_tcp_socket(char *name, char *port)
     return socketfd;
 }
 
-int bind_tcp_socket(uint16_t port, int backlog_size)
+int bind_tcp_socket(uint16_t port, int backlog_size, int reuse_port, const tcp_profile_t *profile)
 {
     struct sockaddr_in addr;
     int socketfd, t = 1;
@@ -125,6 +224,11 @@ int bind_tcp_socket(uint16_t port, int backlog_size)
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
         ERR("setsockopt");
+    // Every socket bound with SO_REUSEPORT gets its own accept queue, the kernel spreads connections among them.
+    if (reuse_port && setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (profile != NULL)
+        apply_tcp_listener_profile(socketfd, profile);
     if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
         ERR("bind");
     if (listen(socketfd, backlog_size) < 0)
@@ -144,6 +248,24 @@ int add_new_client(int sfd)
     return nfd;
 }
 
+/*
+ * The new socket is non-blocking and close-on-exec from the start,
+ * which saves the fcntl calls. Returns -1 if there is none waiting.
+ */
+int accept_client(int sfd)
+{
+    int nfd;
+    if ((nfd = TEMP_FAILURE_RETRY(accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) < 0)
+    {
+        // A connection may be gone before it is accepted, the next one is not.
+        if (EAGAIN == errno || EWOULDBLOCK == errno || ECONNABORTED == errno)
+            return -1;
+        ERR("accept4");
+    }
+    return nfd;
+}
+
+// Accepts a connection of a listening socket configured with the profile.
 ssize_t bulk_read(int fd, char *buf, size_t count)
 {
     int c;
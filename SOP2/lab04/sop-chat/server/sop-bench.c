@@ -0,0 +1,418 @@
+#include "socket-utils.h"
+
+#include <poll.h>
+#include <time.h>
+
+#include "chat.h"
+
+#define BENCH_NAME "bench"
+
+#define ELAPSED_US(start, end) (((end).tv_sec - (start).tv_sec) * 1000000.0 + ((end).tv_nsec - (start).tv_nsec) / 1000.0)
+
+void usage(char *pname);
+int bench_connect(char *host, char *port, char *key);
+void bench_churn(int argc, char **argv);
+void bench_stall(int argc, char **argv);
+void bench_fanout(int argc, char **argv);
+void bench_burst(int argc, char **argv);
+void bench_rooms(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        usage(argv[0]);
+
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("sethandler");
+
+    if (strcmp(argv[1], "churn") == 0)
+        bench_churn(argc, argv);
+    else if (strcmp(argv[1], "stall") == 0)
+        bench_stall(argc, argv);
+    else if (strcmp(argv[1], "fanout") == 0)
+        bench_fanout(argc, argv);
+    else if (strcmp(argv[1], "burst") == 0)
+        bench_burst(argc, argv);
+    else if (strcmp(argv[1], "rooms") == 0)
+        bench_rooms(argc, argv);
+    else
+        usage(argv[0]);
+    return EXIT_SUCCESS;
+}
+
+void usage(char *pname)
+{
+    fprintf(stderr, "USAGE: %s churn host port key max_idle step cycles\n", pname);
+    fprintf(stderr, "       %s stall host port key receivers messages\n", pname);
+    fprintf(stderr, "       %s fanout host port key senders receivers messages\n", pname);
+    fprintf(stderr, "       %s burst host port key senders burst rounds\n", pname);
+    fprintf(stderr, "       %s rooms host port key clients rooms messages\n", pname);
+    exit(EXIT_FAILURE);
+}
+
+int bench_connect(char *host, char *port, char *key)
+{
+    char buffer[BUFF_SIZE];
+    memset(buffer, 0, BUFF_SIZE);
+    strncpy(buffer + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+    strncpy(buffer + MESSAGE_OFFSET, key, MESSAGE_SIZE - 1);
+
+    int fd = connect_tcp_socket(host, port);
+    if (bulk_write(fd, buffer, BUFF_SIZE) < 0)
+        ERR("bulk_write");
+    if (bulk_read(fd, buffer, BUFF_SIZE) < BUFF_SIZE)
+    {
+        fprintf(stderr, "Bench: Server rejected the connection.\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Times connect + handshake + close of one more client next to a growing number of idle ones.
+void bench_churn(int argc, char **argv)
+{
+    if (argc != 8)
+        usage(argv[0]);
+
+    char *host = argv[2];
+    char *port = argv[3];
+    char *key = argv[4];
+    int max_idle = atoi(argv[5]);
+    int step = atoi(argv[6]);
+    int cycles = atoi(argv[7]);
+    if (max_idle < 0 || step <= 0 || cycles <= 0)
+        usage(argv[0]);
+
+    if (raise_fd_limit(max_idle + 16) < max_idle + 16)
+    {
+        fprintf(stderr, "Bench: Descriptor limit is too low for %d connections.\n", max_idle);
+        exit(EXIT_FAILURE);
+    }
+
+    int *idle = malloc(sizeof(int) * (max_idle + 1));
+    if (idle == NULL)
+        ERR("malloc");
+
+    printf("%10s %16s\n", "idle", "avg cycle [us]");
+    int idle_count = 0;
+    for (;;)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < cycles; i++)
+        {
+            int fd = bench_connect(host, port, key);
+            if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+                ERR("close");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%10d %16.1f\n", idle_count, ELAPSED_US(start, end) / cycles);
+
+        if (idle_count + step > max_idle)
+            break;
+        for (int i = 0; i < step; i++)
+            idle[idle_count++] = bench_connect(host, port, key);
+    }
+
+    for (int i = 0; i < idle_count; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(idle[i])) < 0)
+            ERR("close");
+    }
+    free(idle);
+}
+
+// Times delivery to well-behaved receivers while one client never reads.
+void bench_stall(int argc, char **argv)
+{
+    if (argc != 7)
+        usage(argv[0]);
+
+    char *host = argv[2];
+    char *port = argv[3];
+    char *key = argv[4];
+    int receiver_count = atoi(argv[5]);
+    int messages = atoi(argv[6]);
+    if (receiver_count <= 0 || messages <= 0)
+        usage(argv[0]);
+
+    int stalled = bench_connect(host, port, key);
+    int sender = bench_connect(host, port, key);
+    int *receivers = malloc(sizeof(int) * receiver_count);
+    if (receivers == NULL)
+        ERR("malloc");
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    for (int i = 0; i < receiver_count; i++)
+    {
+        receivers[i] = bench_connect(host, port, key);
+        if (setsockopt(receivers[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+            ERR("setsockopt");
+    }
+
+    char buffer[BUFF_SIZE];
+    double total = 0, worst = 0;
+    int delivered = 0;
+    for (; delivered < messages; delivered++)
+    {
+        struct timespec start, end;
+        memset(buffer, 0, BUFF_SIZE);
+        strncpy(buffer + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        snprintf(buffer + MESSAGE_OFFSET, MESSAGE_SIZE, "%ld.%09ld", (long)start.tv_sec, start.tv_nsec);
+        if (bulk_write(sender, buffer, BUFF_SIZE) < 0)
+            ERR("bulk_write");
+
+        int i = 0;
+        for (; i < receiver_count; i++)
+        {
+            if (bulk_read(receivers[i], buffer, BUFF_SIZE) < BUFF_SIZE)
+                break;
+        }
+        if (i < receiver_count)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double latency = ELAPSED_US(start, end);
+        total += latency;
+        if (latency > worst)
+            worst = latency;
+    }
+
+    if (delivered < messages)
+        printf("Fan-out stalled after %d of %d messages\n", delivered, messages);
+    if (delivered > 0)
+        printf("Delivered %d messages to %d receivers: avg %.1f us, max %.1f us\n", delivered, receiver_count,
+               total / delivered, worst);
+
+    for (int i = 0; i < receiver_count; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(receivers[i])) < 0)
+            ERR("close");
+    }
+    free(receivers);
+    if (TEMP_FAILURE_RETRY(close(sender)) < 0)
+        ERR("close");
+    if (TEMP_FAILURE_RETRY(close(stalled)) < 0)
+        ERR("close");
+}
+
+// Senders push as fast as the server takes it, reports the delivery rate seen by the receivers.
+void bench_fanout(int argc, char **argv)
+{
+    if (argc != 8)
+        usage(argv[0]);
+
+    char *host = argv[2];
+    char *port = argv[3];
+    char *key = argv[4];
+    int sender_count = atoi(argv[5]);
+    int receiver_count = atoi(argv[6]);
+    int messages = atoi(argv[7]);
+    if (sender_count <= 0 || receiver_count <= 0 || messages <= 0)
+        usage(argv[0]);
+
+    int count = sender_count + receiver_count;
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * count);
+    long *progress = calloc(count, sizeof(long));
+    if (fds == NULL || progress == NULL)
+        ERR("malloc");
+    for (int i = 0; i < count; i++)
+    {
+        fds[i].fd = bench_connect(host, port, key);
+        fds[i].events = i < sender_count ? POLLIN | POLLOUT : POLLIN;
+    }
+
+    char buffer[BUFF_SIZE];
+    memset(buffer, 0, BUFF_SIZE);
+    strncpy(buffer + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+    strncpy(buffer + MESSAGE_OFFSET, "fanout", MESSAGE_SIZE - 1);
+    char scratch[64 * BUFF_SIZE];
+
+    long expected = (long)sender_count * messages * BUFF_SIZE;
+    int done = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < receiver_count)
+    {
+        int ready = TEMP_FAILURE_RETRY(poll(fds, count, 10000));
+        if (ready < 0)
+            ERR("poll");
+        if (ready == 0)
+        {
+            fprintf(stderr, "Bench: No progress for 10 s, messages were dropped.\n");
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (fds[i].revents & POLLOUT)
+            {
+                // Senders keep their own write offset in progress[] until they are done.
+                ssize_t ret = TEMP_FAILURE_RETRY(write(fds[i].fd, buffer + progress[i] % BUFF_SIZE,
+                                                       BUFF_SIZE - progress[i] % BUFF_SIZE));
+                if (ret < 0)
+                    ERR("write");
+                progress[i] += ret;
+                if (progress[i] == (long)messages * BUFF_SIZE)
+                    fds[i].events = POLLIN;
+            }
+            if (fds[i].revents & POLLIN)
+            {
+                ssize_t ret = TEMP_FAILURE_RETRY(read(fds[i].fd, scratch, sizeof(scratch)));
+                if (ret <= 0)
+                    ERR("read");
+                if (i >= sender_count)
+                {
+                    progress[i] += ret;
+                    if (progress[i] == expected)
+                        done++;
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = ELAPSED_US(start, end) / 1000000.0;
+    printf("Delivered %d of %d receivers' streams: %.0f messages/s per receiver\n", done, receiver_count,
+           (double)sender_count * messages / elapsed);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(fds[i].fd)) < 0)
+            ERR("close");
+    }
+    free(fds);
+    free(progress);
+}
+
+// Every round each sender writes a burst of messages in one call and a receiver waits for all of them.
+void bench_burst(int argc, char **argv)
+{
+    if (argc != 8)
+        usage(argv[0]);
+
+    char *host = argv[2];
+    char *port = argv[3];
+    char *key = argv[4];
+    int sender_count = atoi(argv[5]);
+    int burst = atoi(argv[6]);
+    int rounds = atoi(argv[7]);
+    if (sender_count <= 0 || burst <= 0 || rounds <= 0)
+        usage(argv[0]);
+
+    int receiver = bench_connect(host, port, key);
+    int *senders = malloc(sizeof(int) * sender_count);
+    char *buffer = calloc(burst, BUFF_SIZE);
+    if (senders == NULL || buffer == NULL)
+        ERR("malloc");
+    for (int i = 0; i < sender_count; i++)
+        senders[i] = bench_connect(host, port, key);
+    for (int i = 0; i < burst; i++)
+    {
+        strncpy(buffer + i * BUFF_SIZE + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+        snprintf(buffer + i * BUFF_SIZE + MESSAGE_OFFSET, MESSAGE_SIZE, "burst %d", i);
+    }
+
+    char frame[BUFF_SIZE];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < sender_count; i++)
+        {
+            if (bulk_write(senders[i], buffer, (size_t)burst * BUFF_SIZE) < 0)
+                ERR("bulk_write");
+        }
+        for (int i = 0; i < sender_count * burst; i++)
+        {
+            if (bulk_read(receiver, frame, BUFF_SIZE) < BUFF_SIZE)
+            {
+                fprintf(stderr, "Bench: Server has closed the connection.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Relayed %d bursts of %d messages: %.0f messages/s\n", sender_count * rounds, burst,
+           (double)sender_count * burst * rounds / (ELAPSED_US(start, end) / 1000000.0));
+
+    for (int i = 0; i < sender_count; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(senders[i])) < 0)
+            ERR("close");
+    }
+    free(senders);
+    free(buffer);
+    if (TEMP_FAILURE_RETRY(close(receiver)) < 0)
+        ERR("close");
+}
+
+// Spreads the clients over rooms and times a message round trip within the first one.
+void bench_rooms(int argc, char **argv)
+{
+    if (argc != 8)
+        usage(argv[0]);
+
+    char *host = argv[2];
+    char *port = argv[3];
+    char *key = argv[4];
+    int client_count = atoi(argv[5]);
+    int room_count = atoi(argv[6]);
+    int messages = atoi(argv[7]);
+    if (room_count <= 0 || client_count < 2 * room_count || messages <= 0)
+        usage(argv[0]);
+
+    if (raise_fd_limit(client_count + 16) < client_count + 16)
+    {
+        fprintf(stderr, "Bench: Descriptor limit is too low for %d connections.\n", client_count);
+        exit(EXIT_FAILURE);
+    }
+
+    int *clients = malloc(sizeof(int) * client_count);
+    if (clients == NULL)
+        ERR("malloc");
+    char buffer[BUFF_SIZE];
+    for (int i = 0; i < client_count; i++)
+    {
+        clients[i] = bench_connect(host, port, key);
+        memset(buffer, 0, BUFF_SIZE);
+        strncpy(buffer + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+        snprintf(buffer + MESSAGE_OFFSET, MESSAGE_SIZE, "/join room%d", i % room_count);
+        if (bulk_write(clients[i], buffer, BUFF_SIZE) < 0)
+            ERR("bulk_write");
+    }
+    // Joins are not acknowledged, give the server a moment to process them.
+    usleep(500000);
+
+    double total = 0;
+    for (int m = 0; m < messages; m++)
+    {
+        struct timespec start, end;
+        memset(buffer, 0, BUFF_SIZE);
+        strncpy(buffer + NAME_OFFSET, BENCH_NAME, NAME_SIZE - 1);
+        strncpy(buffer + MESSAGE_OFFSET, "rooms", MESSAGE_SIZE - 1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (bulk_write(clients[0], buffer, BUFF_SIZE) < 0)
+            ERR("bulk_write");
+        for (int i = room_count; i < client_count; i += room_count)
+        {
+            if (bulk_read(clients[i], buffer, BUFF_SIZE) < BUFF_SIZE)
+            {
+                fprintf(stderr, "Bench: Server has closed the connection.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += ELAPSED_US(start, end);
+    }
+
+    printf("%d clients in %d rooms: avg %.1f us per message to a room of %d\n", client_count, room_count,
+           total / messages, (client_count + room_count - 1) / room_count);
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(clients[i])) < 0)
+            ERR("close");
+    }
+    free(clients);
+}
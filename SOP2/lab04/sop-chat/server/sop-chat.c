@@ -1,85 +1,705 @@
 #include "socket-utils.h"
 
-#define BACKLOG_SIZE 10
-#define MAX_CLIENT_COUNT 4
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include "client.h"
+#include "handoff.h"
+#include "history.h"
+#include "keys.h"
+#include "log.h"
+#include "mpsc.h"
+#include "room.h"
+#include "stats.h"
+#include "uring.h"
+#include "wheel.h"
+
+#define BACKLOG_SIZE SOMAXCONN
+// The slab grows as clients arrive, the limit costs only descriptors.
+#define MAX_CLIENT_COUNT 1024
 #define MAX_EVENTS 10
+#define HIGH_WATER_MARK (128 * BUFF_SIZE)
+#define MAX_THREAD_COUNT 256
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define IDLE_TIMEOUT_MS 0
+#define WHEEL_TICK_MS 100
+#define FRAME_BUDGET 16
+// Token buckets count millionths of a message.
+#define TOKEN 1000000L
+#define HISTORY_SIZE 128
+#define HISTORY_MAX_ROOMS 1024
+#define ADMIN_BACKLOG_SIZE 4
+#define ADMIN_SNAPSHOT_SIZE 2048
+#define DRAIN_POLL_MS 100
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 1024
+// A receive never holds more than the input buffer has room for besides an unfinished frame.
+#define URING_BUFFER_SIZE (4 * BUFF_SIZE)
+#define URING_BUFFER_GROUP 0
 
-#define NAME_OFFSET 0
-#define NAME_SIZE 64
-#define MESSAGE_OFFSET NAME_SIZE
-#define MESSAGE_SIZE 448
-#define BUFF_SIZE (NAME_SIZE + MESSAGE_SIZE)
+// io_uring requests carry the client pointer with the kind of request in the lowest bit, client_t is always aligned.
+#define URING_RECV ((uintptr_t)0)
+#define URING_SEND ((uintptr_t)1)
+#define URING_KIND_MASK ((uintptr_t)1)
+// Completions nobody waits for, such as the one of a cancel request.
+#define URING_IGNORE ((uintptr_t)0)
 
-#define UNUSED(x) (void)(x)
 #define EMPTY_KEY "\0"
+#define DEFAULT_TENANT "default"
+#define KEYS_ERROR_SIZE 256
+#define DEFAULT_ROOM "general"
+
+typedef enum slow_policy_t
+{
+    SLOW_POLICY_DROP,
+    SLOW_POLICY_DISCONNECT,
+} slow_policy_t;
+
+typedef enum rate_policy_t
+{
+    RATE_POLICY_DELAY,
+    RATE_POLICY_DROP,
+    RATE_POLICY_DISCONNECT,
+} rate_policy_t;
+
+typedef enum backend_t
+{
+    BACKEND_EPOLL,
+    BACKEND_URING,
+} backend_t;
 
-typedef struct client_t
+typedef struct server_config_t
 {
+    uint16_t port;
+    // Also listens on this Unix socket, a name starting with '@' is in the abstract namespace.
+    char *local_path;
+    char *key;
+    char *keys_path;
+    int max_clients;
+    size_t high_water;
+    slow_policy_t slow_policy;
+    int thread_count;
+    int handshake_timeout_ms;
+    int idle_timeout_ms;
+    int rate;
+    int burst;
+    rate_policy_t rate_policy;
+    int frame_budget;
+    tcp_profile_t tcp_profile;
+    int edge_triggered;
+    backend_t backend;
+    int history_size;
+    char *admin_path;
+    char *handoff_path;
+    char *takeover_path;
+    int takeover_clients;
+    char *log_path;
+    log_level_t log_level;
+    int log_rate;
+} server_config_t;
+
+typedef struct chat_t chat_t;
+
+// A client received from the previous server, waiting for its shard to start.
+typedef struct adopted_client_t
+{
+    struct adopted_client_t *next;
     int fd;
-    char name[NAME_SIZE];
-    int request_counter;
-} client_t;
+    // Only the received part, the input buffer ends after in_len bytes.
+    handoff_record_t record;
+} adopted_client_t;
+
+typedef struct takeover_t
+{
+    int listeners[MAX_THREAD_COUNT];
+    int listener_count;
+    int local_listener;
+    adopted_client_t *clients;
+    int client_count;
+    uint32_t next_id;
+} takeover_t;
+
+/*
+ * A message relayed from another shard, queued in the inbox of the receiving one.
+ * The target is a room name, or a client name for a direct message.
+ */
+typedef struct shard_message_t
+{
+    mpsc_node_t node;
+    relay_t relay;
+    int direct;
+    char target[NAME_SIZE];
+} shard_message_t;
+
+/*
+ * Every thread runs its own server with a SO_REUSEPORT listening socket and
+ * the clients accepted on it, other shards reach them through the inbox.
+ */
+typedef struct server_t
+{
+    chat_t *chat;
+    server_config_t *config;
+    int index;
+    pthread_t tid;
+    int server_socket;
+    // Cleared once the listening socket has been handed over to the next server.
+    int listening;
+    // The last handoff step the shard has been through.
+    int handoff_step;
+    adopted_client_t *adopted;
+    int epoll_descriptor;
+    int event_descriptor;
+    atomic_int wakeup_pending;
+    mpsc_queue_t inbox;
+    // Set while the shard looks a key up, the main thread frees a replaced table only when it is clear.
+    atomic_int reading_keys;
+    client_slab_t clients;
+    room_table_t rooms;
+    client_index_t names;
+    client_t *pending_flush;
+    // Clients whose input is held back, in the order they will be resumed.
+    client_t *held_head;
+    client_t *held_tail;
+    uint64_t resume_pass;
+    int64_t next_resume;
+    // Handshake and idle timeouts of all clients, driven by a single timerfd.
+    int timer_descriptor;
+    timing_wheel_t wheel;
+    uint64_t handshake_ticks;
+    uint64_t idle_ticks;
+    server_stats_t stats;
+    // Only with the io_uring backend, send_iov holds the iovecs of SQE i at i * SEND_BATCH.
+    uring_t ring;
+    struct iovec *send_iov;
+} server_t;
+
+struct chat_t
+{
+    server_config_t *config;
+    server_t *servers;
+    // The Unix listening socket or -1, shared by all shards: whichever is woken accepts.
+    int local_socket;
+    atomic_int client_count;
+    atomic_int running;
+    // Sender ids are unique across shards and never reused, so clients may cache names by id.
+    atomic_uint next_id;
+    history_t history;
+    // Replaced as a whole on SIGHUP, shards never see a table being built.
+    _Atomic(key_table_t *) keys;
+    // Bumped by the main thread for every step of a handoff, every shard answers on handoff_done.
+    atomic_int handoff_step;
+    // A step either sends the clients, if handoff_clients, or stops accepting.
+    int handoff_stop;
+    atomic_int handoff_failed;
+    int handoff_socket;
+    int handoff_clients;
+    int handoff_done;
+    // Handed over, the process exits once its last client is gone.
+    int draining;
+};
 
 volatile sig_atomic_t do_work = 1;
+volatile sig_atomic_t do_reload = 0;
 
 void usage(char *pname);
-void parse_argv(int argc, char **argv, uint16_t *port, char **key);
+void parse_argv(int argc, char **argv, server_config_t *config);
 void sigint_handler(int sig);
+void sighup_handler(int sig);
 void sop_setnonblock(int fd);
-void client_reset(client_t *client);
-int find_index(client_t *clients);
-void server_accept_client(int server_socket, client_t *clients, char *buffer, char *key, int epoll_descriptor);
-void server_disconnect_client(client_t *client, int epoll_descriptor);
-void server_shutdown(client_t *clients, int epoll_descriptor);
-void server_broadcast(client_t *clients, char *buffer, int from, int epoll_descriptor);
-void server_work(int server_socket, char *key, sigset_t oldmask);
+void server_accept_client(server_t *server, client_t *listener);
+void server_adopt_clients(server_t *server);
+client_t *server_admit_client(server_t *server, int client_socket);
+int server_authorize(server_t *server, const char *key, char *tenant);
+int server_handshake(server_t *server, client_t *client, char *frame);
+void server_timers_init(server_t *server);
+void server_timer_start(server_t *server, client_t *client, uint64_t ticks);
+void server_tick(server_t *server);
+void server_timeout(server_t *server, client_t *client);
+void server_disconnect_client(server_t *server, client_t *client);
+void server_release_client(server_t *server, client_t *client);
+void server_handoff(server_t *server, client_t *listener, client_t *local_listener);
+void server_handoff_clients(server_t *server);
+void server_shutdown(server_t *server);
+void server_update_events(server_t *server, client_t *client);
+int server_flush(server_t *server, client_t *client);
+void server_flush_pending(server_t *server);
+int server_send(server_t *server, client_t *client, message_t *message);
+int server_deliver(server_t *server, client_t *client, relay_t *relay);
+void server_broadcast(server_t *server, room_t *room, relay_t *relay, client_t *from);
+void server_direct(server_t *server, const char *name, relay_t *relay, client_t *from);
+void server_forward(server_t *server, relay_t *relay, int direct, const char *target);
+void server_drain_inbox(server_t *server);
+void server_replay(server_t *server, client_t *client, uint32_t sequence);
+int server_command(server_t *server, client_t *client, char *line);
+int server_relay(server_t *server, client_t *client, const char *text, size_t size);
+int server_parse(server_t *server, client_t *client, int forced);
+void server_read(server_t *server, client_t *client);
+int64_t server_clock(void);
+int server_take_token(server_t *server, client_t *client, int64_t *resume_at);
+void server_hold(server_t *server, client_t *client, int64_t resume_at);
+void server_unhold(server_t *server, client_t *client);
+int server_resume(server_t *server);
+void server_resume_client(server_t *server, client_t *client);
+void server_work(server_t *server);
+struct io_uring_sqe *server_sqe(server_t *server);
+void server_uring_accept(server_t *server, client_t *listener, int client_socket);
+void server_uring_recv(server_t *server, client_t *client);
+int server_uring_send(server_t *server, client_t *client);
+void server_uring_received(server_t *server, client_t *client, struct io_uring_cqe *cqe);
+void server_uring_sent(server_t *server, client_t *client, int result);
+void server_work_uring(server_t *server);
+void *server_thread(void *arg);
+void server_wakeup(server_t *server);
+void server_stop(void);
+void admin_serve(chat_t *chat, int admin_socket);
+void handoff_run_step(chat_t *chat, int stop);
+int handoff_fail(int connection, const char *reason);
+int handoff_serve(chat_t *chat, int *handoff_listener);
+void takeover_receive(server_config_t *config, takeover_t *takeover);
+key_table_t *keys_load(server_config_t *config);
+void keys_reload(chat_t *chat);
 
 int main(int argc, char **argv)
 {
-    uint16_t port;
-    char *key;
-    parse_argv(argc, argv, &port, &key);
-    fprintf(stderr, "Server: port = %hu, key = %s\n", port, key);
+    server_config_t config;
+    parse_argv(argc, argv, &config);
+    fprintf(stderr, "Server: port = %hu, %s = %s, max clients = %d, high water = %zu, threads = %d, %s\n",
+            config.port, config.keys_path != NULL ? "key file" : "key",
+            config.keys_path != NULL ? config.keys_path : config.key, config.max_clients, config.high_water, config.thread_count,
+            config.backend == BACKEND_URING ? "io_uring"
+            : config.edge_triggered         ? "edge-triggered"
+                                            : "level-triggered");
+    if (config.local_path != NULL)
+        fprintf(stderr, "Server: Also listening on Unix socket %s\n", config.local_path);
+    if (config.backend == BACKEND_URING && config.handoff_path != NULL)
+        fprintf(stderr, "Server: The io_uring backend hands over its listening sockets only, clients stay until they leave.\n");
+    // Every client holds one descriptor, leave some room for the listening socket, epoll etc.
+    if (raise_fd_limit(config.max_clients + 16) < config.max_clients + 16)
+        fprintf(stderr, "Server: Descriptor limit is too low, not every client will fit.\n");
 
     if (sethandler(SIG_IGN, SIGPIPE))
         ERR("sethandler");
     if (sethandler(sigint_handler, SIGINT))
         ERR("sethandler");
+    if (sethandler(sighup_handler, SIGHUP))
+        ERR("sethandler");
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
     if (sigprocmask(SIG_BLOCK, &mask, &oldmask))
         ERR("sigprocmask");
 
-    int server_socket = bind_tcp_socket(port, BACKLOG_SIZE);
-    sop_setnonblock(server_socket);
-    server_work(server_socket, key, oldmask);
+    takeover_t takeover;
+    memset(&takeover, 0, sizeof(takeover));
+    takeover.next_id = 1;
+    takeover.local_listener = -1;
+    if (config.takeover_path != NULL)
+    {
+        takeover_receive(&config, &takeover);
+        // The clients taken over may be more than --max-clients reserved descriptors for.
+        if (raise_fd_limit(config.max_clients + 16) < config.max_clients + 16)
+            fprintf(stderr, "Server: Descriptor limit is too low, not every client will fit.\n");
+    }
+    log_start(config.log_path, config.log_level, config.log_rate);
+
+    chat_t chat;
+    chat.config = &config;
+    // A taken over Unix socket is kept even without --unix, its clients expect it to be there.
+    chat.local_socket = takeover.local_listener;
+    if (chat.local_socket == -1 && config.local_path != NULL)
+        chat.local_socket = bind_local_socket(config.local_path, BACKLOG_SIZE);
+    if (chat.local_socket != -1)
+        sop_setnonblock(chat.local_socket);
+    atomic_init(&chat.client_count, 0);
+    atomic_init(&chat.running, 1);
+    atomic_init(&chat.next_id, takeover.next_id);
+    atomic_init(&chat.keys, keys_load(&config));
+    atomic_init(&chat.handoff_step, 0);
+    atomic_init(&chat.handoff_failed, 0);
+    chat.handoff_socket = -1;
+    chat.draining = 0;
+    if ((chat.handoff_done = eventfd(0, EFD_SEMAPHORE)) < 0)
+        ERR("eventfd");
+    history_init(&chat.history, config.history_size, HISTORY_MAX_ROOMS);
+    if ((chat.servers = calloc(config.thread_count, sizeof(server_t))) == NULL)
+        ERR("calloc");
+
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        server_t *server = &chat.servers[i];
+        server->chat = &chat;
+        server->config = &config;
+        server->index = i;
+        if (config.takeover_path != NULL)
+            server->server_socket = takeover.listeners[i];
+        else
+            server->server_socket = bind_tcp_socket(config.port, BACKLOG_SIZE, config.thread_count > 1, &config.tcp_profile);
+        sop_setnonblock(server->server_socket);
+        server->listening = 1;
+        server->handoff_step = 0;
+        server->adopted = NULL;
+        server->held_head = server->held_tail = NULL;
+        server->resume_pass = 0;
+        server->next_resume = INT64_MAX;
+        if ((server->event_descriptor = eventfd(0, EFD_NONBLOCK)) < 0)
+            ERR("eventfd");
+        atomic_init(&server->wakeup_pending, 0);
+        atomic_init(&server->reading_keys, 0);
+        mpsc_init(&server->inbox);
+        stats_init(&server->stats);
+    }
+    for (int i = 0; takeover.clients != NULL; i = (i + 1) % config.thread_count)
+    {
+        adopted_client_t *adopted = takeover.clients;
+        takeover.clients = adopted->next;
+        adopted->next = chat.servers[i].adopted;
+        chat.servers[i].adopted = adopted;
+    }
+    int admin_socket = -1;
+    if (config.admin_path != NULL)
+    {
+        admin_socket = bind_local_socket(config.admin_path, ADMIN_BACKLOG_SIZE);
+        sop_setnonblock(admin_socket);
+    }
+    int handoff_listener = -1;
+    if (config.handoff_path != NULL)
+    {
+        handoff_listener = handoff_listen(config.handoff_path);
+        sop_setnonblock(handoff_listener);
+    }
+    // Shards inherit the blocked SIGINT and SIGHUP, they are only ever delivered to the main thread.
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        if (pthread_create(&chat.servers[i].tid, NULL, server_thread, &chat.servers[i]))
+            ERR("pthread_create");
+    }
+
+    // The main thread only waits for signals and answers the admin and handoff sockets.
+    while (do_work)
+    {
+        if (do_reload)
+        {
+            do_reload = 0;
+            keys_reload(&chat);
+            continue;
+        }
+        if (chat.draining && atomic_load(&chat.client_count) == 0)
+            break;
+        struct pollfd sockets[2];
+        int socket_count = 0;
+        if (admin_socket != -1)
+            sockets[socket_count++] = (struct pollfd){.fd = admin_socket, .events = POLLIN};
+        if (handoff_listener != -1)
+            sockets[socket_count++] = (struct pollfd){.fd = handoff_listener, .events = POLLIN};
+        // Nothing tells the main thread that the last client has left, a draining server checks now and then.
+        struct timespec drain = {.tv_sec = 0, .tv_nsec = DRAIN_POLL_MS * 1000000L};
+        if (ppoll(sockets, socket_count, chat.draining ? &drain : NULL, &oldmask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("ppoll");
+        }
+        for (int i = 0; i < socket_count; i++)
+        {
+            if (!(sockets[i].revents & POLLIN))
+                continue;
+            if (sockets[i].fd == admin_socket)
+                admin_serve(&chat, admin_socket);
+            else
+                handoff_serve(&chat, &handoff_listener);
+        }
+    }
+
+    atomic_store(&chat.running, 0);
+    for (int i = 0; i < config.thread_count; i++)
+        server_wakeup(&chat.servers[i]);
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        server_t *server = &chat.servers[i];
+        if (pthread_join(server->tid, NULL))
+            ERR("pthread_join");
+    }
+    stats_snapshot_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        server_t *server = &chat.servers[i];
+        // No shard is running anymore, release whatever was relayed after its owner stopped.
+        server_drain_inbox(server);
+        stats_collect(&server->stats, &total);
+        if (TEMP_FAILURE_RETRY(close(server->event_descriptor)) < 0)
+            ERR("close");
+        if (TEMP_FAILURE_RETRY(close(server->server_socket)) < 0)
+            ERR("close");
+    }
+    free(chat.servers);
+    if (chat.local_socket != -1)
+    {
+        if (TEMP_FAILURE_RETRY(close(chat.local_socket)) < 0)
+            ERR("close");
+        // After a handoff the path belongs to the successor.
+        if (!chat.draining && config.local_path != NULL && config.local_path[0] != '@' &&
+            unlink(config.local_path) < 0 && errno != ENOENT)
+            ERR("unlink");
+    }
+    if (TEMP_FAILURE_RETRY(close(chat.handoff_done)) < 0)
+        ERR("close");
+    if (handoff_listener != -1)
+    {
+        if (TEMP_FAILURE_RETRY(close(handoff_listener)) < 0)
+            ERR("close");
+        if (unlink(config.handoff_path) < 0 && errno != ENOENT)
+            ERR("unlink");
+    }
+    history_destroy(&chat.history);
+    key_table_free(atomic_load(&chat.keys));
+    if (admin_socket != -1)
+    {
+        if (TEMP_FAILURE_RETRY(close(admin_socket)) < 0)
+            ERR("close");
+        if (unlink(config.admin_path) < 0 && errno != ENOENT)
+            ERR("unlink");
+    }
 
+    log_stop();
     if (sigprocmask(SIG_UNBLOCK, &mask, NULL))
         ERR("sigprocmask");
 
-    if (TEMP_FAILURE_RETRY(close(server_socket)) < 0)
-        ERR("close");
+    fprintf(stderr, "Server: %ld system calls in the event loops\n", total.syscalls);
+    if (total.messages_in > 0)
+        fprintf(stderr, "Server: %ld messages received in %ld wakeups (%.3f wakeups per message)\n", total.messages_in,
+                total.wakeups, (double)total.wakeups / total.messages_in);
+    if (total.messages_out > 0)
+        fprintf(stderr, "Server: %ld messages delivered with %ld write calls (%.3f per message)\n", total.messages_out,
+                total.write_calls, (double)total.write_calls / total.messages_out);
     fprintf(stderr, "Server: Terminating.\n");
     return EXIT_SUCCESS;
 }
 
 void usage(char *pname)
 {
-    fprintf(stderr, "USAGE: %s port key\n", pname);
+    fprintf(stderr,
+            "USAGE: %s [--max-clients N] [--high-water BYTES] [--slow-policy drop|disconnect] [--threads N]\n"
+            "          [--keys FILE] [--handshake-timeout MS] [--idle-timeout MS]\n"
+            "          [--rate MESSAGES_PER_S] [--burst N] [--rate-policy delay|drop|disconnect] [--frame-budget N]\n"
+            "          [--tcp-profile none|latency|throughput] [--defer-accept S] [--busy-poll USEC]\n"
+            "          [--edge-triggered] [--backend epoll|uring] [--history N]\n"
+            "          [--admin PATH] [--log FILE] [--log-level error|warning|info|message] [--log-rate N]\n"
+            "          [--handoff PATH] [--takeover PATH [--takeover-clients]]\n"
+            "          [--unix PATH] [--quiet] port key\n",
+            pname);
     exit(EXIT_FAILURE);
 }
 
-void parse_argv(int argc, char **argv, uint16_t *port, char **key)
+void parse_argv(int argc, char **argv, server_config_t *config)
 {
-    *key = EMPTY_KEY;
-    if (argc < 2 || argc > 3)
+    static struct option options[] = {
+        {"max-clients", required_argument, NULL, 'm'},
+        {"high-water", required_argument, NULL, 'w'},
+        {"slow-policy", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"handshake-timeout", required_argument, NULL, 'h'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"rate", required_argument, NULL, 'R'},
+        {"burst", required_argument, NULL, 'B'},
+        {"rate-policy", required_argument, NULL, 'P'},
+        {"frame-budget", required_argument, NULL, 'F'},
+        {"tcp-profile", required_argument, NULL, 'N'},
+        {"defer-accept", required_argument, NULL, 'D'},
+        {"busy-poll", required_argument, NULL, 'Y'},
+        {"edge-triggered", no_argument, NULL, 'e'},
+        {"backend", required_argument, NULL, 'b'},
+        {"history", required_argument, NULL, 'H'},
+        {"keys", required_argument, NULL, 'k'},
+        {"admin", required_argument, NULL, 'a'},
+        {"log", required_argument, NULL, 'l'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"log-rate", required_argument, NULL, 'r'},
+        {"unix", required_argument, NULL, 'U'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"handoff", required_argument, NULL, 'o'},
+        {"takeover", required_argument, NULL, 'T'},
+        {"takeover-clients", no_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->key = EMPTY_KEY;
+    config->keys_path = NULL;
+    config->max_clients = MAX_CLIENT_COUNT;
+    config->high_water = HIGH_WATER_MARK;
+    config->slow_policy = SLOW_POLICY_DROP;
+    config->thread_count = 1;
+    config->handshake_timeout_ms = HANDSHAKE_TIMEOUT_MS;
+    config->idle_timeout_ms = IDLE_TIMEOUT_MS;
+    config->rate = 0;
+    config->burst = 0;
+    config->rate_policy = RATE_POLICY_DELAY;
+    config->frame_budget = FRAME_BUDGET;
+    tcp_profile_parse("latency", &config->tcp_profile);
+    config->edge_triggered = 0;
+    config->backend = BACKEND_EPOLL;
+    config->history_size = HISTORY_SIZE;
+    config->admin_path = NULL;
+    config->local_path = NULL;
+    config->handoff_path = NULL;
+    config->takeover_path = NULL;
+    config->takeover_clients = 0;
+    config->log_path = NULL;
+    config->log_level = LOG_MESSAGE;
+    config->log_rate = 0;
+    // Given apart from the profile, which --tcp-profile replaces as a whole.
+    int defer_accept = -1;
+    int busy_poll = -1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:w:p:t:h:i:R:B:P:F:N:D:Y:eb:H:k:a:l:L:r:U:qo:T:C", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                if (sscanf(optarg, "%d", &config->max_clients) != 1 || config->max_clients <= 0)
+                    usage(argv[0]);
+                break;
+            case 'w':
+                if (sscanf(optarg, "%zu", &config->high_water) != 1 || config->high_water < BUFF_SIZE)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (strcmp(optarg, "drop") == 0)
+                    config->slow_policy = SLOW_POLICY_DROP;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    config->slow_policy = SLOW_POLICY_DISCONNECT;
+                else
+                    usage(argv[0]);
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &config->thread_count) != 1 || config->thread_count <= 0 ||
+                    config->thread_count > MAX_THREAD_COUNT)
+                    usage(argv[0]);
+                break;
+            case 'h':
+                if (sscanf(optarg, "%d", &config->handshake_timeout_ms) != 1 || config->handshake_timeout_ms <= 0)
+                    usage(argv[0]);
+                break;
+            case 'i':
+                if (sscanf(optarg, "%d", &config->idle_timeout_ms) != 1 || config->idle_timeout_ms < 0)
+                    usage(argv[0]);
+                break;
+            case 'R':
+                if (sscanf(optarg, "%d", &config->rate) != 1 || config->rate < 0 || config->rate > TOKEN)
+                    usage(argv[0]);
+                break;
+            case 'B':
+                if (sscanf(optarg, "%d", &config->burst) != 1 || config->burst <= 0)
+                    usage(argv[0]);
+                break;
+            case 'P':
+                if (strcmp(optarg, "delay") == 0)
+                    config->rate_policy = RATE_POLICY_DELAY;
+                else if (strcmp(optarg, "drop") == 0)
+                    config->rate_policy = RATE_POLICY_DROP;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    config->rate_policy = RATE_POLICY_DISCONNECT;
+                else
+                    usage(argv[0]);
+                break;
+            case 'F':
+                if (sscanf(optarg, "%d", &config->frame_budget) != 1 || config->frame_budget <= 0)
+                    usage(argv[0]);
+                break;
+            case 'N':
+                if (tcp_profile_parse(optarg, &config->tcp_profile) < 0)
+                    usage(argv[0]);
+                break;
+            case 'D':
+                if (sscanf(optarg, "%d", &defer_accept) != 1 || defer_accept < 0)
+                    usage(argv[0]);
+                break;
+            case 'Y':
+                if (sscanf(optarg, "%d", &busy_poll) != 1 || busy_poll < 0)
+                    usage(argv[0]);
+                break;
+            case 'e':
+                config->edge_triggered = 1;
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0)
+                    config->backend = BACKEND_EPOLL;
+                else if (strcmp(optarg, "uring") == 0)
+                    config->backend = BACKEND_URING;
+                else
+                    usage(argv[0]);
+                break;
+            case 'H':
+                if (sscanf(optarg, "%d", &config->history_size) != 1 || config->history_size < 0)
+                    usage(argv[0]);
+                break;
+            case 'k':
+                config->keys_path = optarg;
+                break;
+            case 'a':
+                config->admin_path = optarg;
+                break;
+            case 'l':
+                config->log_path = optarg;
+                break;
+            case 'L':
+                if (log_parse_level(optarg, &config->log_level))
+                    usage(argv[0]);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d", &config->log_rate) != 1 || config->log_rate < 0)
+                    usage(argv[0]);
+                break;
+            case 'U':
+                if (strlen(optarg) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+                    usage(argv[0]);
+                config->local_path = optarg;
+                break;
+            case 'q':
+                // Everything but the messages themselves.
+                config->log_level = LOG_INFO;
+                break;
+            case 'o':
+                config->handoff_path = optarg;
+                break;
+            case 'T':
+                config->takeover_path = optarg;
+                break;
+            case 'C':
+                config->takeover_clients = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (defer_accept >= 0)
+        config->tcp_profile.defer_accept = defer_accept;
+    if (busy_poll >= 0)
+        config->tcp_profile.busy_poll = busy_poll;
+    // Completions have no notion of edges.
+    if (config->backend == BACKEND_URING && config->edge_triggered)
+        usage(argv[0]);
+    if (config->takeover_clients && config->takeover_path == NULL)
+        usage(argv[0]);
+    // A second worth of messages may be sent at once unless told otherwise.
+    if (config->burst == 0)
+        config->burst = config->rate > 0 ? config->rate : 1;
+    // With a key file the key is not given on the command line.
+    if (argc - optind < 1 || argc - optind > (config->keys_path != NULL ? 1 : 2))
         usage(argv[0]);
-    if (sscanf(argv[1], "%hu", port) != 1)
+    if (sscanf(argv[optind], "%hu", &config->port) != 1)
         usage(argv[0]);
-    if (argc > 2)
-        *key = argv[2];
+    if (argc - optind > 1)
+        config->key = argv[optind + 1];
 }
 
 void sigint_handler(int sig)
@@ -88,6 +708,12 @@ void sigint_handler(int sig)
     do_work = 0;
 }
 
+void sighup_handler(int sig)
+{
+    UNUSED(sig);
+    do_reload = 1;
+}
+
 void sop_setnonblock(int fd)
 {
     int oldflags = fcntl(fd, F_GETFL, 0);
@@ -98,201 +724,1611 @@ void sop_setnonblock(int fd)
         ERR("fcntl");
 }
 
-void client_reset(client_t *client)
+/*
+ * Only accepts the connection, the handshake is driven by the event loop
+ * like any other traffic and bounded by a timeout, so a slow or malicious
+ * connector never holds up the other clients.
+ */
+void server_accept_client(server_t *server, client_t *listener)
 {
-    client->fd = -1;
-    client->request_counter = 0;
-    memset(client->name, 0, NAME_SIZE);
+    // Events for the listening sockets may still be in the batch which handed them over.
+    if (!server->listening)
+        return;
+    stats_add(&server->stats.syscalls, 1);
+    int local = listener->fd != server->server_socket;
+    int client_socket = accept_client(listener->fd);
+    if (client_socket == -1)
+        return;
+    client_t *client = server_admit_client(server, client_socket);
+    if (client == NULL)
+        return;
+    if (local)
+        stats_add(&server->stats.accepted_local, 1);
+
+    // An edge-triggered client is registered for both directions once, level-triggered ones toggle EPOLLOUT.
+    struct epoll_event event;
+    event.events = client->events = server->config->edge_triggered ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN;
+    event.data.ptr = client;
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, client_socket, &event) == -1)
+        ERR("epoll_ctl");
 }
 
-int find_index(client_t *clients)
+/*
+ * Gives the clients received from the previous server a slot, as if they
+ * had just finished their handshake, and goes on with whatever unfinished
+ * message they had sent. Called by the shard before its event loop starts.
+ */
+void server_adopt_clients(server_t *server)
 {
-    for (int i = 1; i <= MAX_CLIENT_COUNT; i++)
+    while (server->adopted != NULL)
     {
-        if (clients[i].fd == -1)
-            return i;
+        adopted_client_t *adopted = server->adopted;
+        server->adopted = adopted->next;
+
+        atomic_fetch_add(&server->chat->client_count, 1);
+        client_t *client = client_slab_alloc(&server->clients);
+        client->fd = adopted->fd;
+        client->state = CLIENT_ACTIVE;
+        client->framed = adopted->record.flags;
+        client->id = adopted->record.id;
+        strncpy(client->name, adopted->record.name, NAME_SIZE - 1);
+        client->name_frame = message_new_frame(FRAME_NAME, client->id, client->name, strlen(client->name));
+        room_join(&server->rooms, adopted->record.room, client);
+        client_index_add(&server->names, client);
+        memcpy(client->in, adopted->record.in, adopted->record.in_len);
+        client->in_len = adopted->record.in_len;
+        client->last_active = server->wheel.now;
+        if (server->idle_ticks > 0)
+            server_timer_start(server, client, server->idle_ticks);
+        client->tokens = (int64_t)server->config->burst * TOKEN;
+        client->refilled_at = server->config->rate > 0 ? server_clock() : 0;
+        free(adopted);
+        log_write(LOG_INFO, "Server: %s has been taken over", client->name);
+
+        if (server->config->backend == BACKEND_URING)
+            server_uring_recv(server, client);
+        else
+        {
+            struct epoll_event event;
+            event.events = client->events = server->config->edge_triggered ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN;
+            event.data.ptr = client;
+            if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, client->fd, &event) == -1)
+                ERR("epoll_ctl");
+        }
+        if (client->in_len > 0)
+            server_parse(server, client, 0);
     }
-    return -1;
 }
 
-void server_accept_client(int server_socket, client_t *clients, char *buffer, char *key, int epoll_descriptor)
+/*
+ * Takes a slot for the new connection, or closes it if the server is full.
+ */
+client_t *server_admit_client(server_t *server, int client_socket)
 {
-    int ret;
-    int client_socket = add_new_client(server_socket);
-    if (client_socket == -1)
-        return;
-
-    fprintf(stderr, "Server: A new client is trying to connect.\n");
-    int client_idx = find_index(clients);
-    if (client_idx == -1)
+    log_write(LOG_INFO, "Server: A new client is trying to connect.");
+    // The limit is shared by all shards, unfinished handshakes count as well.
+    if (atomic_fetch_add(&server->chat->client_count, 1) >= server->config->max_clients)
     {
-        fprintf(stderr, "Server: Not enough space for a new client!\n");
+        atomic_fetch_sub(&server->chat->client_count, 1);
+        stats_add(&server->stats.rejected, 1);
+        log_write(LOG_WARNING, "Server: Not enough space for a new client!");
         if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
             ERR("close");
-        return;
+        return NULL;
     }
+    stats_add(&server->stats.accepted, 1);
 
-    memset(buffer, 0, BUFF_SIZE);
-    if ((ret = bulk_read(client_socket, buffer, BUFF_SIZE)) <= 0)
+    client_t *client = client_slab_alloc(&server->clients);
+    client->fd = client_socket;
+    client->state = CLIENT_HANDSHAKE;
+    server_timer_start(server, client, server->handshake_ticks);
+    return client;
+}
+
+/*
+ * Looks the key up in the current key table and copies the tenant it belongs to.
+ * A reload may replace the table meanwhile, the flag keeps the old one alive
+ * until the lookup is over. Returns -1 for an unknown key.
+ */
+int server_authorize(server_t *server, const char *key, char *tenant)
+{
+    atomic_store(&server->reading_keys, 1);
+    const key_entry_t *entry = key_table_find(atomic_load(&server->chat->keys), key);
+    if (entry != NULL)
+        memcpy(tenant, entry->tenant, NAME_SIZE);
+    atomic_store(&server->reading_keys, 0);
+    return entry != NULL ? 0 : -1;
+}
+
+/*
+ * Called once the whole name + key frame has been read, an authorized client
+ * gets it echoed. Returns -1 if the client was rejected.
+ */
+int server_handshake(server_t *server, client_t *client, char *frame)
+{
+    char *client_name = frame;
+    char *client_key = frame + MESSAGE_OFFSET;
+    frame[NAME_SIZE - 1] = '\0';
+    frame[BUFF_SIZE - 1] = '\0';
+
+    log_write(LOG_INFO, "Server: %s is a new client", client_name);
+
+    char tenant[NAME_SIZE];
+    if (server_authorize(server, client_key, tenant) < 0)
     {
-        fprintf(stderr, "Server: Client discarded.\n");
-        if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
-            ERR("close");
-        return;
+        log_write(LOG_WARNING, "Server: %s has an incorrect key.", client_name);
+        log_write(LOG_WARNING, "Server: %s has been rejected", client_name);
+        server_disconnect_client(server, client);
+        return -1;
+    }
+
+    log_write(LOG_INFO, "Server: %s has a correct key of %s.", client_name, tenant);
+    client->state = CLIENT_ACTIVE;
+    if (server->idle_ticks > 0)
+        server_timer_start(server, client, server->idle_ticks);
+    else
+        wheel_remove(&server->wheel, &client->timer);
+    client->tokens = (int64_t)server->config->burst * TOKEN;
+    client->refilled_at = server->config->rate > 0 ? server_clock() : 0;
+    strncpy(client->name, client_name, NAME_SIZE - 1);
+    client->id = atomic_fetch_add(&server->chat->next_id, 1);
+    client->name_frame = message_new_frame(FRAME_NAME, client->id, client->name, strlen(client->name));
+    room_join(&server->rooms, DEFAULT_ROOM, client);
+    client_index_add(&server->names, client);
+
+    if (memcmp(frame + FRAMED_MAGIC_OFFSET, FRAMED_REQUEST, FRAMED_MAGIC_SIZE) == 0)
+    {
+        client->framed = 1;
+        memcpy(frame + FRAMED_MAGIC_OFFSET, FRAMED_ACCEPT, FRAMED_MAGIC_SIZE);
+        log_write(LOG_INFO, "Server: %s uses framed messages.", client->name);
     }
 
-    char *client_name = buffer;
-    char *client_key = buffer + MESSAGE_OFFSET;
+    message_t *reply = message_new(frame, BUFF_SIZE);
+    server_send(server, client, reply);
+    message_unref(reply);
+    return 0;
+}
 
-    fprintf(stderr, "Server: %s is a new client with a key = %s\n", client_name, key);
 
-    if (strcmp(key, client_key) != 0)
+void server_disconnect_client(server_t *server, client_t *client)
+{
+    if (client->pending_flush)
     {
-        fprintf(stderr, "Server: %s has an incorrect key.\n", client_name);
-        fprintf(stderr, "Server: %s has been rejected\n", client_name);
-        if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
-            ERR("close");
+        if (client->flush_prev != NULL)
+            client->flush_prev->flush_next = client->flush_next;
+        else
+            server->pending_flush = client->flush_next;
+        if (client->flush_next != NULL)
+            client->flush_next->flush_prev = client->flush_prev;
+    }
+    if (client->state == CLIENT_ACTIVE)
+    {
+        room_leave(&server->rooms, client);
+        client_index_remove(&server->names, client);
+    }
+    stats_add(client->state == CLIENT_ACTIVE ? &server->stats.disconnected : &server->stats.rejected, 1);
+    stats_add(&server->stats.queued_bytes, -(long)client->out.size);
+    stats_add(&server->stats.queued_messages, -client->out.count);
+    atomic_fetch_sub(&server->chat->client_count, 1);
+    wheel_remove(&server->wheel, &client->timer);
+    if (client->held)
+        server_unhold(server, client);
+
+    if (server->config->backend == BACKEND_URING)
+    {
+        // Pending requests still point at the slot and the queued messages, the shutdown makes them complete.
+        client->state = CLIENT_CLOSED;
+        if (shutdown(client->fd, SHUT_RDWR) < 0 && errno != ENOTCONN)
+            ERR("shutdown");
+        if (client->inflight == 0)
+            server_release_client(server, client);
         return;
     }
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, client->fd, NULL) == -1)
+        ERR("epoll_ctl");
+    server_release_client(server, client);
+}
+
+void server_release_client(server_t *server, client_t *client)
+{
+    if (TEMP_FAILURE_RETRY(close(client->fd)) < 0)
+        ERR("close");
+    client_slab_free(&server->clients, client);
+}
+
 
-    fprintf(stderr, "Server: %s has a correct key.\n", client_name);
-    if ((ret = bulk_write(client_socket, buffer, BUFF_SIZE)) < 0)
+// Run by every shard for each step of a handoff: handing the clients over, then to stop accepting.
+void server_handoff(server_t *server, client_t *listener, client_t *local_listener)
+{
+    server->handoff_step = atomic_load(&server->chat->handoff_step);
+    if (!server->chat->handoff_stop)
     {
-        if (errno == EPIPE)
-        {
-            fprintf(stderr, "Server: %s has disconnected\n", client_name);
-            if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
-                ERR("close");
-        }
-        else
-            ERR("bulk_write");
+        if (server->chat->handoff_clients)
+            server_handoff_clients(server);
+    }
+    else if (server->config->backend == BACKEND_URING)
+    {
+        server->listening = 0;
+        uring_prep_cancel(server_sqe(server), (uintptr_t)listener, URING_IGNORE);
+        if (local_listener->fd != -1)
+            uring_prep_cancel(server_sqe(server), (uintptr_t)local_listener, URING_IGNORE);
     }
     else
     {
-        clients[client_idx].fd = client_socket;
-        strncpy(clients[client_idx].name, client_name, NAME_SIZE);
+        server->listening = 0;
+        if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, server->server_socket, NULL) == -1)
+            ERR("epoll_ctl");
+        if (local_listener->fd != -1 && epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, local_listener->fd, NULL) == -1)
+            ERR("epoll_ctl");
+    }
+    uint64_t done = 1;
+    if (TEMP_FAILURE_RETRY(write(server->chat->handoff_done, &done, sizeof(done))) < 0)
+        ERR("write");
+}
+
+/*
+ * Sends every authorized client with nothing left to send to the successor
+ * and forgets about it. A client with queued messages still gets them here,
+ * moving the queue would cost more than the old server draining it.
+ */
+void server_handoff_clients(server_t *server)
+{
+    server_flush_pending(server);
+    int count = 0;
+    client_t *next;
+    for (client_t *client = server->clients.live; client != NULL; client = next)
+    {
+        next = client->next;
+        if (client->state != CLIENT_ACTIVE || client->out.size > 0)
+            continue;
+
+        handoff_record_t record;
+        record.type = HANDOFF_CLIENT;
+        record.flags = client->framed;
+        record.id = client->id;
+        record.in_len = client->in_len;
+        memcpy(record.name, client->name, NAME_SIZE);
+        strncpy(record.room, client->room != NULL ? client->room->name : DEFAULT_ROOM, NAME_SIZE);
+        memcpy(record.in, client->in, client->in_len);
+        if (handoff_send(server->chat->handoff_socket, &record, client->fd) < 0)
+        {
+            log_write(LOG_ERROR, "Server: Cannot hand %s over: %s", client->name, strerror(errno));
+            atomic_store(&server->chat->handoff_failed, 1);
+            break;
+        }
 
-        struct epoll_event event;
-        event.events = EPOLLIN;
-        event.data.ptr = &clients[client_idx];
-        if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, client_socket, &event) == -1)
+        if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_DEL, client->fd, NULL) == -1)
             ERR("epoll_ctl");
+        room_leave(&server->rooms, client);
+        client_index_remove(&server->names, client);
+        wheel_remove(&server->wheel, &client->timer);
+        if (client->held)
+            server_unhold(server, client);
+        atomic_fetch_sub(&server->chat->client_count, 1);
+        stats_add(&server->stats.handed_off, 1);
+        server_release_client(server, client);
+        count++;
     }
+    log_write(LOG_INFO, "Server: %d clients handed over by shard %d", count, server->index);
 }
 
-void server_disconnect_client(client_t *client, int epoll_descriptor)
+void server_timers_init(server_t *server)
 {
-    if (epoll_ctl(epoll_descriptor, EPOLL_CTL_DEL, client->fd, NULL) == -1)
-        ERR("epoll_ctl");
-    if (TEMP_FAILURE_RETRY(close(client->fd)) < 0)
-        ERR("close");
-    client->fd = -1;
+    wheel_init(&server->wheel);
+    server->handshake_ticks = (server->config->handshake_timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    server->idle_ticks = (server->config->idle_timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if ((server->timer_descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+        ERR("timerfd_create");
 }
 
-void server_shutdown(client_t *clients, int epoll_descriptor)
+/*
+ * (Re)starts the client's timeout, a pending one is simply moved. The timerfd
+ * only ticks while the wheel holds any timer, an idle shard is not woken up.
+ */
+void server_timer_start(server_t *server, client_t *client, uint64_t ticks)
 {
-    for (int i = 1; i <= MAX_CLIENT_COUNT; i++)
+    if (server->wheel.count == 0)
     {
-        if (clients[i].fd != -1 && TEMP_FAILURE_RETRY(close(clients[i].fd)) < 0)
-            ERR("close");
+        struct itimerspec tick;
+        tick.it_value.tv_sec = tick.it_interval.tv_sec = WHEEL_TICK_MS / 1000;
+        tick.it_value.tv_nsec = tick.it_interval.tv_nsec = (WHEEL_TICK_MS % 1000) * 1000000L;
+        if (timerfd_settime(server->timer_descriptor, 0, &tick, NULL))
+            ERR("timerfd_settime");
     }
-    if (TEMP_FAILURE_RETRY(close(epoll_descriptor)) < 0)
-        ERR("close");
+    wheel_add(&server->wheel, &client->timer, ticks);
 }
 
-void server_broadcast(client_t *clients, char *buffer, int from, int epoll_descriptor)
+/*
+ * Moves the wheel by as many ticks as the timerfd has counted. The handlers
+ * may release clients, the next expired timer is picked before each one runs.
+ */
+void server_tick(server_t *server)
 {
-    int ret;
-    char *from_name = buffer;
-    for (int i = 1; i <= MAX_CLIENT_COUNT; i++)
+    uint64_t expirations;
+    if (TEMP_FAILURE_RETRY(read(server->timer_descriptor, &expirations, sizeof(expirations))) < 0)
+    {
+        if (errno != EAGAIN)
+            ERR("read");
+        return;
+    }
+    for (; expirations > 0; expirations--)
     {
-        int fd = clients[i].fd;
-        if (fd >= 0 && fd != from)
+        wheel_timer_t *next;
+        for (wheel_timer_t *timer = wheel_advance(&server->wheel); timer != NULL; timer = next)
         {
-            if ((ret = bulk_write(fd, buffer, BUFF_SIZE)) < 0)
-            {
-                if (errno == EPIPE)
-                {
-                    fprintf(stderr, "Server: %s has disconnected\n", from_name);
-                    server_disconnect_client(&clients[i], epoll_descriptor);
-                }
-                else
-                    ERR("bulk_write");
-            }
+            next = timer->next;
+            server_timeout(server, (client_t *)((char *)timer - offsetof(client_t, timer)));
         }
     }
+    if (server->wheel.count == 0)
+    {
+        struct itimerspec stop;
+        memset(&stop, 0, sizeof(stop));
+        if (timerfd_settime(server->timer_descriptor, 0, &stop, NULL))
+            ERR("timerfd_settime");
+    }
 }
 
-void server_work(int server_socket, char *key, sigset_t oldmask)
+/*
+ * An active client is not rescheduled on every message, reading only records
+ * the tick. When its timer runs out, a client which was heard from in the
+ * meantime gets a new timer for the rest of its idle timeout.
+ */
+void server_timeout(server_t *server, client_t *client)
 {
-    int ret;
-    client_t clients[MAX_CLIENT_COUNT + 1];
-    for (int i = 0; i <= MAX_CLIENT_COUNT; i++)
-        client_reset(&clients[i]);
+    if (client->state == CLIENT_HANDSHAKE)
+    {
+        log_write(LOG_WARNING, "Server: Client discarded, the handshake has timed out.");
+        stats_add(&server->stats.timed_out, 1);
+        server_disconnect_client(server, client);
+        return;
+    }
+    if (client->state != CLIENT_ACTIVE)
+        return;
+    uint64_t idle = server->wheel.now - client->last_active;
+    if (idle < server->idle_ticks)
+    {
+        server_timer_start(server, client, server->idle_ticks - idle);
+        return;
+    }
+    log_write(LOG_WARNING, "Server: %s has been idle for too long and has been disconnected", client->name);
+    stats_add(&server->stats.timed_out, 1);
+    server_disconnect_client(server, client);
+}
 
-    struct epoll_event event, events[MAX_EVENTS];
+void server_shutdown(server_t *server)
+{
+    if (server->config->backend == BACKEND_URING)
+    {
+        uring_destroy(&server->ring);
+        free(server->send_iov);
+    }
+    for (client_t *client = server->clients.live; client != NULL; client = client->next)
+    {
+        if (TEMP_FAILURE_RETRY(close(client->fd)) < 0)
+            ERR("close");
+    }
+    if (TEMP_FAILURE_RETRY(close(server->timer_descriptor)) < 0)
+        ERR("close");
+    client_slab_destroy(&server->clients);
+    room_table_destroy(&server->rooms);
+    client_index_destroy(&server->names);
+    if (server->config->backend == BACKEND_EPOLL && TEMP_FAILURE_RETRY(close(server->epoll_descriptor)) < 0)
+        ERR("close");
+}
 
-    int epoll_descriptor;
-    if ((epoll_descriptor = epoll_create1(0)) < 0)
-        ERR("epoll_create:");
+void server_update_events(server_t *server, client_t *client)
+{
+    if (server->config->edge_triggered)
+        return;
+    // A held client is not read until it is resumed.
+    uint32_t events = (client->held ? 0 : EPOLLIN) | (client->out.size > 0 ? EPOLLOUT : 0);
+    if (events == client->events)
+        return;
 
-    clients[0].fd = server_socket;
-    event.events = EPOLLIN;
-    event.data.ptr = &clients[0];
-    if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, server_socket, &event) == -1)
+    struct epoll_event event;
+    event.events = client->events = events;
+    event.data.ptr = client;
+    stats_add(&server->stats.syscalls, 1);
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_MOD, client->fd, &event) == -1)
         ERR("epoll_ctl");
+}
 
-    int nfds;
-    char buffer[BUFF_SIZE];
-    memset(buffer, 0, BUFF_SIZE);
+/*
+ * Writes as much of the client's queue as the socket takes, SEND_BATCH
+ * messages per writev. Returns -1 if the client was released.
+ */
+int server_flush(server_t *server, client_t *client)
+{
+    if (server->config->backend == BACKEND_URING)
+        return server_uring_send(server, client);
 
-    while (do_work)
+    struct iovec iov[SEND_BATCH];
+    int count;
+    while ((count = send_queue_peek(&client->out, iov, SEND_BATCH)) > 0)
     {
-        if ((nfds = epoll_pwait(epoll_descriptor, events, MAX_EVENTS, -1, &oldmask)) <= 0)
+        size_t total = 0;
+        for (int i = 0; i < count; i++)
+            total += iov[i].iov_len;
+
+        stats_add(&server->stats.write_calls, 1);
+        stats_add(&server->stats.syscalls, 1);
+        ssize_t ret = TEMP_FAILURE_RETRY(writev(client->fd, iov, count));
+        if (ret < 0)
         {
-            if (errno == EINTR && !do_work)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
                 break;
-            ERR("epoll_pwait");
-        }
-        for (int i = 0; i < nfds && do_work; i++)
-        {
-            client_t *client = (client_t *)events[i].data.ptr;
-            int fd = client->fd;
-            if (fd == server_socket)
+            if (errno == EPIPE || errno == ECONNRESET)
             {
-                if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
-                {
-                    fprintf(stderr, "Server: Unexpected error with server socket!\n");
-                    do_work = 0;
-                    continue;
-                }
-                else if (events[i].events & EPOLLIN)
-                    server_accept_client(server_socket, clients, buffer, key, epoll_descriptor);
-                continue;
+                log_write(LOG_INFO, "Server: %s has disconnected", client->name);
+                server_disconnect_client(server, client);
+                return -1;
             }
+            ERR("writev");
+        }
+        int completed = send_queue_consume(&client->out, ret);
+        stats_add(&server->stats.messages_out, completed);
+        stats_add(&server->stats.bytes_out, ret);
+        stats_add(&server->stats.queued_bytes, -ret);
+        stats_add(&server->stats.queued_messages, -completed);
+        // A short write means the socket buffer is full, do not waste a call on EAGAIN.
+        if ((size_t)ret < total)
+            break;
+    }
+    client->write_blocked = client->out.size > 0;
+    server_update_events(server, client);
+    return 0;
+}
 
-            if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
-            {
-                fprintf(stderr, "Server: %s has disconnected\n", client->name);
-                server_disconnect_client(client, epoll_descriptor);
-                continue;
-            }
-            if (events[i].events & EPOLLIN)
-            {
-                memset(buffer, 0, BUFF_SIZE);
-                if ((ret = bulk_read(fd, buffer, BUFF_SIZE)) <= 0)
-                {
-                    fprintf(stderr, "Server: %s has disconnected\n", client->name);
-                    server_disconnect_client(client, epoll_descriptor);
-                    continue;
-                }
-                else
-                {
-                    fprintf(stderr, "%s: %s\n", buffer, buffer + MESSAGE_OFFSET);
-                    server_broadcast(clients, buffer, fd, epoll_descriptor);
-                }
-            }
+/*
+ * Flushes every client that got new messages during the last epoll wakeup,
+ * so each of them costs at most one writev no matter how many messages it got.
+ */
+void server_flush_pending(server_t *server)
+{
+    while (server->pending_flush != NULL)
+    {
+        client_t *client = server->pending_flush;
+        server->pending_flush = client->flush_next;
+        if (server->pending_flush != NULL)
+            server->pending_flush->flush_prev = NULL;
+        client->pending_flush = 0;
+        client->flush_next = NULL;
+        // Clients waiting for EPOLLOUT, or for a send in flight, are flushed when their socket is writable again.
+        if (!client->write_blocked)
+            server_flush(server, client);
+    }
+}
+
+/*
+ * Queues the message, past the high-water mark it is dropped or the client
+ * disconnected, as the policy says. Returns -1 if the message was not queued.
+ */
+int server_send(server_t *server, client_t *client, message_t *message)
+{
+    if (client->out.size + message->size > server->config->high_water)
+    {
+        if (server->config->slow_policy == SLOW_POLICY_DISCONNECT)
+        {
+            log_write(LOG_WARNING, "Server: %s is too slow and has been disconnected", client->name);
+            server_disconnect_client(server, client);
+            return -1;
         }
+        stats_add(&server->stats.dropped, 1);
+        if (client->dropped++ == 0)
+            log_write(LOG_WARNING, "Server: %s is too slow, dropping messages", client->name);
+        return -1;
     }
-    server_shutdown(clients, epoll_descriptor);
-}
\ No newline at end of file
+
+    send_queue_push(&client->out, message);
+    stats_add(&server->stats.queued_bytes, message->size);
+    stats_add(&server->stats.queued_messages, 1);
+    stats_max(&server->stats.max_queue_bytes, client->out.size);
+    if (!client->pending_flush)
+    {
+        client->pending_flush = 1;
+        client->flush_prev = NULL;
+        client->flush_next = server->pending_flush;
+        if (server->pending_flush != NULL)
+            server->pending_flush->flush_prev = client;
+        server->pending_flush = client;
+    }
+    return 0;
+}
+
+/*
+ * Queues the relay in the client's encoding. A framed client gets the sender's
+ * name before its first message and afterwards only the sender id.
+ * Returns -1 if the message was not queued.
+ */
+int server_deliver(server_t *server, client_t *client, relay_t *relay)
+{
+    if (!client->framed)
+        return server_send(server, client, relay->legacy);
+
+    uint32_t *known = &client->known_senders[relay->sender_id % KNOWN_SENDERS];
+    if (*known != relay->sender_id)
+    {
+        if (server_send(server, client, relay->name) < 0)
+            return -1;
+        *known = relay->sender_id;
+    }
+    return server_send(server, client, relay->framed);
+}
+
+void server_broadcast(server_t *server, room_t *room, relay_t *relay, client_t *from)
+{
+    client_t *next;
+    for (client_t *client = room->members; client != NULL; client = next)
+    {
+        next = client->room_next;
+        if (client != from)
+            server_deliver(server, client, relay);
+    }
+}
+
+void server_direct(server_t *server, const char *name, relay_t *relay, client_t *from)
+{
+    client_t *next;
+    for (client_t *client = client_index_find(&server->names, name); client != NULL; client = next)
+    {
+        next = client_index_next(client);
+        if (client != from)
+            server_deliver(server, client, relay);
+    }
+}
+
+// Hands the message to the other shards which may have its recipients, a burst costs one wakeup.
+void server_forward(server_t *server, relay_t *relay, int direct, const char *target)
+{
+    uint32_t hash = name_hash(target);
+    for (int i = 0; i < server->config->thread_count; i++)
+    {
+        server_t *other = &server->chat->servers[i];
+        if (other == server)
+            continue;
+        if (direct ? !client_index_maybe_present(&other->names, hash) : !room_maybe_present(&other->rooms, hash))
+            continue;
+
+        shard_message_t *item = malloc(sizeof(shard_message_t));
+        if (item == NULL)
+            ERR("malloc");
+        item->relay = relay_ref(relay);
+        item->direct = direct;
+        memset(item->target, 0, NAME_SIZE);
+        strncpy(item->target, target, NAME_SIZE - 1);
+        mpsc_push(&other->inbox, &item->node);
+        if (!atomic_exchange(&other->wakeup_pending, 1))
+            server_wakeup(other);
+    }
+}
+
+void server_wakeup(server_t *server)
+{
+    uint64_t value = 1;
+    if (TEMP_FAILURE_RETRY(write(server->event_descriptor, &value, sizeof(value))) < 0 && errno != EAGAIN)
+        ERR("write");
+}
+
+void server_drain_inbox(server_t *server)
+{
+    uint64_t value;
+    atomic_store(&server->wakeup_pending, 0);
+    stats_add(&server->stats.syscalls, 1);
+    if (TEMP_FAILURE_RETRY(read(server->event_descriptor, &value, sizeof(value))) < 0 && errno != EAGAIN)
+        ERR("read");
+
+    mpsc_node_t *node;
+    while ((node = mpsc_pop(&server->inbox)) != NULL)
+    {
+        shard_message_t *item = (shard_message_t *)node;
+        if (atomic_load_explicit(&server->chat->running, memory_order_relaxed))
+        {
+            room_t *room;
+            if (item->direct)
+                server_direct(server, item->target, &item->relay, NULL);
+            else if ((room = room_find(&server->rooms, item->target)) != NULL)
+                server_broadcast(server, room, &item->relay, NULL);
+        }
+        relay_release(&item->relay);
+        free(item);
+    }
+}
+
+/*
+ * Stops the whole server from any shard: the main thread is the only one
+ * with SIGINT unblocked, it wakes every shard up.
+ */
+void server_stop(void)
+{
+    if (kill(getpid(), SIGINT))
+        ERR("kill");
+}
+
+/*
+ * Queues the messages of the client's room it has missed since the given
+ * sequence number, through the same send queue and buffers as live messages.
+ * The replay stops early if the client turns out to be too slow for it.
+ */
+void server_replay(server_t *server, client_t *client, uint32_t sequence)
+{
+    if (server->config->history_size == 0)
+        return;
+    relay_t *relays = malloc(server->config->history_size * sizeof(relay_t));
+    if (relays == NULL)
+        ERR("malloc");
+
+    int count = history_since(&server->chat->history, client->room->name, sequence, relays);
+    log_write(LOG_INFO, "Server: %s catches up on %d messages of %s", client->name, count, client->room->name);
+    int i = 0;
+    for (; i < count && server_deliver(server, client, &relays[i]) == 0; i++)
+        relay_release(&relays[i]);
+    for (; i < count; i++)
+        relay_release(&relays[i]);
+    free(relays);
+}
+
+/*
+ * Chat commands, sent as ordinary messages:
+ *   /join ROOM      moves the client to ROOM, it only gets the messages sent there
+ *   /leave          moves the client back to DEFAULT_ROOM
+ *   /msg NAME TEXT  sends TEXT only to the clients called NAME
+ *   /history [SEQ]  replays the messages of the client's room numbered after SEQ
+ * Returns -1 if the line is not a command and should be relayed as it is.
+ */
+int server_command(server_t *server, client_t *client, char *line)
+{
+    char *arguments = strchr(line, ' ');
+    if (arguments != NULL)
+        *arguments++ = '\0';
+    else
+        arguments = line + strlen(line);
+
+    if (strcmp(line, "/join") == 0)
+    {
+        if (*arguments == '\0' || strchr(arguments, ' ') != NULL || strlen(arguments) >= NAME_SIZE)
+        {
+            log_write(LOG_WARNING, "Server: %s has sent an invalid room name", client->name);
+            return 0;
+        }
+        room_join(&server->rooms, arguments, client);
+        log_write(LOG_INFO, "Server: %s has joined %s", client->name, client->room->name);
+        return 0;
+    }
+    if (strcmp(line, "/leave") == 0)
+    {
+        room_join(&server->rooms, DEFAULT_ROOM, client);
+        log_write(LOG_INFO, "Server: %s is back in %s", client->name, client->room->name);
+        return 0;
+    }
+    if (strcmp(line, "/msg") == 0)
+    {
+        char *text = strchr(arguments, ' ');
+        if (text == NULL || text - arguments >= NAME_SIZE)
+        {
+            log_write(LOG_WARNING, "Server: %s has sent an invalid direct message", client->name);
+            return 0;
+        }
+        *text++ = '\0';
+        log_message(client->name, arguments, 1, text, strlen(text));
+        relay_t relay;
+        relay_init(&relay, client->id, client->name_frame, client->name, text, strlen(text));
+        server_direct(server, arguments, &relay, client);
+        server_forward(server, &relay, 1, arguments);
+        relay_release(&relay);
+        return 0;
+    }
+    if (strcmp(line, "/history") == 0)
+    {
+        unsigned int sequence = 0;
+        if (*arguments != '\0' && sscanf(arguments, "%u", &sequence) != 1)
+        {
+            log_write(LOG_WARNING, "Server: %s has sent an invalid sequence number", client->name);
+            return 0;
+        }
+        server_replay(server, client, sequence);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Returns -1 if the client was disconnected, which only a replay of
+ * the history can do to the sender.
+ */
+int server_relay(server_t *server, client_t *client, const char *text, size_t size)
+{
+    stats_add(&server->stats.messages_in, 1);
+    if (size > 0 && text[0] == '/')
+    {
+        char line[MESSAGE_SIZE];
+        memcpy(line, text, size);
+        line[size] = '\0';
+        // A released client has its descriptor reset, one with io_uring requests pending is closed.
+        if (server_command(server, client, line) == 0)
+            return client->fd == -1 || client->state == CLIENT_CLOSED ? -1 : 0;
+    }
+
+    log_message(client->name, client->room->name, 0, text, size);
+    relay_t relay;
+    relay_init(&relay, client->id, client->name_frame, client->name, text, size);
+    history_record(&server->chat->history, client->room->name, &relay);
+    server_broadcast(server, client->room, &relay, client);
+    server_forward(server, &relay, 0, client->room->name);
+    relay_release(&relay);
+    return 0;
+}
+
+/*
+ * Handles the complete frames in the client's input buffer, at most
+ * --frame-budget messages and what --rate allows unless forced. A client with
+ * messages left is held and resumed later. Returns -1 if it was disconnected.
+ */
+int server_parse(server_t *server, client_t *client, int forced)
+{
+    int offset = 0;
+    int budget = server->config->frame_budget;
+    for (;;)
+    {
+        char *frame = client->in + offset;
+        int available = client->in_len - offset;
+        int size, text_size;
+        char *text;
+        if (client->state == CLIENT_HANDSHAKE || !client->framed)
+        {
+            if (available < BUFF_SIZE)
+                break;
+            if (client->state == CLIENT_HANDSHAKE)
+            {
+                offset += BUFF_SIZE;
+                if (server_handshake(server, client, frame) < 0)
+                    return -1;
+                continue;
+            }
+            frame[BUFF_SIZE - 1] = '\0';
+            size = BUFF_SIZE;
+            text = frame + MESSAGE_OFFSET;
+            text_size = strlen(text);
+        }
+        else
+        {
+            if (available < FRAME_HEADER_SIZE)
+                break;
+            uint16_t length;
+            memcpy(&length, frame, sizeof(length));
+            length = ntohs(length);
+            uint8_t type = (uint8_t)frame[2];
+            if (type != FRAME_MESSAGE || length >= MESSAGE_SIZE)
+            {
+                log_write(LOG_WARNING, "Server: %s has sent an invalid frame and has been disconnected", client->name);
+                server_disconnect_client(server, client);
+                return -1;
+            }
+            if (available < FRAME_HEADER_SIZE + length)
+                break;
+            size = FRAME_HEADER_SIZE + length;
+            text = frame + FRAME_HEADER_SIZE;
+            text_size = length;
+        }
+
+        if (!forced && budget-- == 0)
+        {
+            stats_add(&server->stats.deferred, 1);
+            server_hold(server, client, 0);
+            break;
+        }
+        int64_t resume_at;
+        if (!server_take_token(server, client, &resume_at))
+        {
+            stats_add(&server->stats.throttled, 1);
+            // A forced pass takes the token anyway, the bucket goes into debt.
+            if (forced)
+                client->tokens -= TOKEN;
+            else
+            {
+                if (server->config->rate_policy == RATE_POLICY_DISCONNECT)
+                {
+                    log_write(LOG_WARNING, "Server: %s sends too fast and has been disconnected", client->name);
+                    server_disconnect_client(server, client);
+                    return -1;
+                }
+                if (server->config->rate_policy == RATE_POLICY_DELAY)
+                {
+                    server_hold(server, client, resume_at);
+                    break;
+                }
+                stats_add(&server->stats.rate_dropped, 1);
+                if (client->rate_dropped++ == 0)
+                    log_write(LOG_WARNING, "Server: %s sends too fast, dropping its messages", client->name);
+                offset += size;
+                continue;
+            }
+        }
+        offset += size;
+        if (server_relay(server, client, text, text_size) < 0)
+            return -1;
+    }
+    client->in_len -= offset;
+    memmove(client->in, client->in + offset, client->in_len);
+    return 0;
+}
+
+/*
+ * Reads what the socket holds and handles every complete frame in it.
+ * An edge-triggered socket is drained until EAGAIN, no further event
+ * comes for data which is already there.
+ */
+void server_read(server_t *server, client_t *client)
+{
+    if (client->held)
+        return;
+    do
+    {
+        stats_add(&server->stats.syscalls, 1);
+        ssize_t ret =
+            TEMP_FAILURE_RETRY(read(client->fd, client->in + client->in_len, CLIENT_IN_SIZE - client->in_len));
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (ret < 0 && errno != ECONNRESET)
+            ERR("read");
+        if (ret <= 0)
+        {
+            if (client->state == CLIENT_HANDSHAKE)
+                log_write(LOG_INFO, "Server: Client discarded.");
+            else
+                log_write(LOG_INFO, "Server: %s has disconnected", client->name);
+            server_disconnect_client(server, client);
+            return;
+        }
+
+        client->in_len += ret;
+        client->last_active = server->wheel.now;
+        if (server_parse(server, client, 0) < 0)
+            return;
+    } while (server->config->edge_triggered && !client->held);
+}
+
+int64_t server_clock(void)
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+        ERR("clock_gettime");
+    return (int64_t)now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * Takes a token for one message from the client's bucket, which is refilled
+ * with --rate tokens a second up to --burst. Returns 0 and the time the next
+ * token will be there in resume_at if the bucket is empty.
+ */
+int server_take_token(server_t *server, client_t *client, int64_t *resume_at)
+{
+    int64_t rate = server->config->rate;
+    if (rate == 0)
+        return 1;
+    int64_t now = server_clock();
+    // Capped, so that the product cannot overflow after a long silence.
+    int64_t elapsed = now - client->refilled_at < 1000000000000L ? now - client->refilled_at : 1000000000000L;
+    client->refilled_at = now;
+    client->tokens += elapsed * rate / 1000;
+    if (client->tokens > (int64_t)server->config->burst * TOKEN)
+        client->tokens = (int64_t)server->config->burst * TOKEN;
+    if (client->tokens >= TOKEN)
+    {
+        client->tokens -= TOKEN;
+        return 1;
+    }
+    *resume_at = now + (TOKEN - client->tokens) * 1000 / rate;
+    return 0;
+}
+
+/*
+ * Stops reading the client until resume_at, 0 meaning the next iteration of
+ * the event loop. Whatever it has sent stays in the socket, so a flooding
+ * client is held back by TCP flow control instead of the server's memory.
+ */
+void server_hold(server_t *server, client_t *client, int64_t resume_at)
+{
+    client->resume_at = resume_at;
+    if (resume_at < server->next_resume)
+        server->next_resume = resume_at;
+    if (client->held)
+        return;
+    client->held = 1;
+    client->held_pass = server->resume_pass;
+    client->held_next = NULL;
+    client->held_prev = server->held_tail;
+    if (server->held_tail != NULL)
+        server->held_tail->held_next = client;
+    else
+        server->held_head = client;
+    server->held_tail = client;
+
+    if (server->config->backend == BACKEND_URING)
+    {
+        // Receives already on their way are still delivered, see server_uring_received.
+        if (client->receiving)
+            uring_prep_cancel(server_sqe(server), (uintptr_t)client | URING_RECV, URING_IGNORE);
+    }
+    else
+        server_update_events(server, client);
+}
+
+void server_unhold(server_t *server, client_t *client)
+{
+    if (client->held_prev != NULL)
+        client->held_prev->held_next = client->held_next;
+    else
+        server->held_head = client->held_next;
+    if (client->held_next != NULL)
+        client->held_next->held_prev = client->held_prev;
+    else
+        server->held_tail = client->held_prev;
+    client->held = 0;
+    client->held_prev = NULL;
+    client->held_next = NULL;
+}
+
+/*
+ * Gives every held client another pass in turn. Returns how long the event
+ * loop may sleep before the next one is due in milliseconds, -1 for no limit.
+ */
+int server_resume(server_t *server)
+{
+    if (server->held_head == NULL)
+        return -1;
+    server->resume_pass++;
+    server->next_resume = INT64_MAX;
+    int64_t now = server_clock();
+    while (server->held_head != NULL && server->held_head->held_pass < server->resume_pass)
+    {
+        client_t *client = server->held_head;
+        server_unhold(server, client);
+        if (client->resume_at > now)
+            server_hold(server, client, client->resume_at);
+        else
+            server_resume_client(server, client);
+    }
+    if (server->next_resume == INT64_MAX)
+        return -1;
+    if (server->next_resume <= now)
+        return 0;
+    return (int)((server->next_resume - now + 999999) / 1000000);
+}
+
+/*
+ * Parses what the client had left and, unless it is held again, reads it
+ * again: an edge-triggered socket has to be read right away, as its edge
+ * may have gone by while the client was held.
+ */
+void server_resume_client(server_t *server, client_t *client)
+{
+    if (server_parse(server, client, 0) < 0 || client->held)
+        return;
+    if (server->config->backend == BACKEND_URING)
+    {
+        if (!client->receiving)
+            server_uring_recv(server, client);
+    }
+    else if (server->config->edge_triggered)
+        server_read(server, client);
+    else
+        server_update_events(server, client);
+}
+
+void *server_thread(void *arg)
+{
+    server_t *server = (server_t *)arg;
+    if (server->config->backend == BACKEND_URING)
+        server_work_uring(server);
+    else
+        server_work(server);
+    return NULL;
+}
+
+void server_work(server_t *server)
+{
+    client_slab_init(&server->clients, server->config->max_clients);
+    room_table_init(&server->rooms);
+    client_index_init(&server->names);
+    server->pending_flush = NULL;
+
+    struct epoll_event event, events[MAX_EVENTS];
+
+    if ((server->epoll_descriptor = epoll_create1(0)) < 0)
+        ERR("epoll_create:");
+
+    client_t listener;
+    client_reset(&listener);
+    listener.fd = server->server_socket;
+    event.events = EPOLLIN;
+    event.data.ptr = &listener;
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, server->server_socket, &event) == -1)
+        ERR("epoll_ctl");
+
+    // Every shard waits on the Unix socket, EPOLLEXCLUSIVE wakes just one of them per connection.
+    client_t local_listener;
+    client_reset(&local_listener);
+    local_listener.fd = server->chat->local_socket;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &local_listener;
+    if (local_listener.fd != -1 && epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, local_listener.fd, &event) == -1)
+        ERR("epoll_ctl");
+
+    client_t waker;
+    client_reset(&waker);
+    waker.fd = server->event_descriptor;
+    event.events = EPOLLIN;
+    event.data.ptr = &waker;
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, server->event_descriptor, &event) == -1)
+        ERR("epoll_ctl");
+
+    server_timers_init(server);
+    client_t ticker;
+    client_reset(&ticker);
+    ticker.fd = server->timer_descriptor;
+    event.events = EPOLLIN;
+    event.data.ptr = &ticker;
+    if (epoll_ctl(server->epoll_descriptor, EPOLL_CTL_ADD, server->timer_descriptor, &event) == -1)
+        ERR("epoll_ctl");
+    server_adopt_clients(server);
+
+    int nfds;
+    int timeout = -1;
+
+    while (atomic_load_explicit(&server->chat->running, memory_order_relaxed))
+    {
+        stats_add(&server->stats.syscalls, 1);
+        if ((nfds = epoll_wait(server->epoll_descriptor, events, MAX_EVENTS, timeout)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        stats_add(&server->stats.wakeups, 1);
+        for (int i = 0; i < nfds && atomic_load_explicit(&server->chat->running, memory_order_relaxed); i++)
+        {
+            client_t *client = (client_t *)events[i].data.ptr;
+            int fd = client->fd;
+            if (fd == -1)
+                continue;
+            if (client == &listener || client == &local_listener)
+            {
+                if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                {
+                    log_write(LOG_ERROR, "Server: Unexpected error with server socket!");
+                    server_stop();
+                    continue;
+                }
+                else if (events[i].events & EPOLLIN)
+                    server_accept_client(server, client);
+                continue;
+            }
+            if (client == &waker)
+            {
+                server_drain_inbox(server);
+                if (server->listening && atomic_load(&server->chat->handoff_step) != server->handoff_step)
+                    server_handoff(server, &listener, &local_listener);
+                continue;
+            }
+            if (client == &ticker)
+            {
+                server_tick(server);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            {
+                log_write(LOG_INFO, "Server: %s has disconnected", client->name);
+                server_disconnect_client(server, client);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && server_flush(server, client) < 0)
+                continue;
+            if (events[i].events & EPOLLIN)
+                server_read(server, client);
+        }
+        timeout = server_resume(server);
+        server_flush_pending(server);
+        client_slab_recycle(&server->clients);
+    }
+    server_shutdown(server);
+}
+
+/*
+ * Returns a free SQE, submitting the queued ones first if the ring is full.
+ */
+struct io_uring_sqe *server_sqe(server_t *server)
+{
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(&server->ring)) == NULL)
+    {
+        stats_add(&server->stats.syscalls, 1);
+        if (uring_submit(&server->ring, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            ERR("io_uring_enter");
+    }
+    return sqe;
+}
+
+// The connection was accepted by the multishot accept request.
+void server_uring_accept(server_t *server, client_t *listener, int client_socket)
+{
+    int local = listener->fd != server->server_socket;
+    client_t *client = server_admit_client(server, client_socket);
+    if (client == NULL)
+        return;
+    if (local)
+        stats_add(&server->stats.accepted_local, 1);
+    server_uring_recv(server, client);
+}
+
+/*
+ * Arms a multishot receive: it keeps completing with whatever arrives,
+ * each time in a buffer the kernel takes from the provided ring.
+ */
+void server_uring_recv(server_t *server, client_t *client)
+{
+    uring_prep_recv_multishot(server_sqe(server), client->fd, URING_BUFFER_GROUP, (uintptr_t)client | URING_RECV);
+    client->inflight++;
+    client->receiving = 1;
+}
+
+/*
+ * Queues one writev of the client's queue, up to SEND_BATCH messages, unless
+ * one is already in flight: the next one goes out when it completes, which
+ * keeps the messages in order. The queued messages stay referenced until then.
+ */
+int server_uring_send(server_t *server, client_t *client)
+{
+    if (client->write_blocked || client->out.size == 0)
+        return 0;
+
+    struct io_uring_sqe *sqe = server_sqe(server);
+    struct iovec *iov = &server->send_iov[uring_sqe_index(&server->ring, sqe) * SEND_BATCH];
+    int count = send_queue_peek(&client->out, iov, SEND_BATCH);
+    uring_prep_writev(sqe, client->fd, iov, count, (uintptr_t)client | URING_SEND);
+    stats_add(&server->stats.write_calls, 1);
+    client->inflight++;
+    client->write_blocked = 1;
+    return 0;
+}
+
+/*
+ * A held client has its receive cancelled, but completions may still come
+ * before the cancellation does. They are kept in the input buffer, one which
+ * does not fit makes a forced pass over the buffer first.
+ */
+void server_uring_received(server_t *server, client_t *client, struct io_uring_cqe *cqe)
+{
+    int result = cqe->res;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        client->receiving = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (client->state != CLIENT_CLOSED && result > 0 && client->in_len + result > CLIENT_IN_SIZE &&
+            server_parse(server, client, 1) < 0)
+        {
+            uring_buffer_recycle(&server->ring, id);
+            return;
+        }
+        if (client->state != CLIENT_CLOSED && result > 0)
+        {
+            memcpy(client->in + client->in_len, uring_buffer(&server->ring, id), result);
+            client->in_len += result;
+            client->last_active = server->wheel.now;
+        }
+        uring_buffer_recycle(&server->ring, id);
+    }
+    if (client->state == CLIENT_CLOSED)
+        return;
+
+    if (result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED))
+    {
+        if (client->state == CLIENT_HANDSHAKE)
+            log_write(LOG_INFO, "Server: Client discarded.");
+        else
+            log_write(LOG_INFO, "Server: %s has disconnected", client->name);
+        server_disconnect_client(server, client);
+        return;
+    }
+    if (result > 0 && !client->held && server_parse(server, client, 0) < 0)
+        return;
+    // The kernel ends a multishot receive when it runs out of buffers, for instance.
+    if (!client->receiving && !client->held)
+        server_uring_recv(server, client);
+}
+
+void server_uring_sent(server_t *server, client_t *client, int result)
+{
+    client->write_blocked = 0;
+    if (client->state == CLIENT_CLOSED)
+        return;
+    if (result < 0)
+    {
+        log_write(LOG_INFO, "Server: %s has disconnected", client->name);
+        server_disconnect_client(server, client);
+        return;
+    }
+
+    int completed = send_queue_consume(&client->out, result);
+    stats_add(&server->stats.messages_out, completed);
+    stats_add(&server->stats.bytes_out, result);
+    stats_add(&server->stats.queued_bytes, -result);
+    stats_add(&server->stats.queued_messages, -completed);
+    server_uring_send(server, client);
+}
+
+/*
+ * The io_uring flavour of server_work, one io_uring_enter per iteration. A
+ * disconnected client keeps its slot until its last request completes.
+ */
+void server_work_uring(server_t *server)
+{
+    client_slab_init(&server->clients, server->config->max_clients);
+    room_table_init(&server->rooms);
+    client_index_init(&server->names);
+    server->pending_flush = NULL;
+
+    if (uring_init(&server->ring, URING_ENTRIES) < 0)
+        ERR("io_uring_setup");
+    uring_buffers_init(&server->ring, URING_BUFFER_COUNT, URING_BUFFER_SIZE, URING_BUFFER_GROUP);
+    if ((server->send_iov = malloc(server->ring.sq_entries * SEND_BATCH * sizeof(struct iovec))) == NULL)
+        ERR("malloc");
+    server_timers_init(server);
+
+    client_t listener;
+    client_reset(&listener);
+    listener.fd = server->server_socket;
+    uring_prep_accept_multishot(server_sqe(server), listener.fd, (uintptr_t)&listener);
+
+    // Each ring has its own accept on the shared Unix socket, the kernel completes one of them per connection.
+    client_t local_listener;
+    client_reset(&local_listener);
+    local_listener.fd = server->chat->local_socket;
+    if (local_listener.fd != -1)
+        uring_prep_accept_multishot(server_sqe(server), local_listener.fd, (uintptr_t)&local_listener);
+
+    client_t waker;
+    client_reset(&waker);
+    waker.fd = server->event_descriptor;
+    uring_prep_poll_multishot(server_sqe(server), waker.fd, (uintptr_t)&waker);
+
+    client_t ticker;
+    client_reset(&ticker);
+    ticker.fd = server->timer_descriptor;
+    uring_prep_poll_multishot(server_sqe(server), ticker.fd, (uintptr_t)&ticker);
+    server_adopt_clients(server);
+
+    int timeout = -1;
+    while (atomic_load_explicit(&server->chat->running, memory_order_relaxed))
+    {
+        stats_add(&server->stats.syscalls, 1);
+        if (uring_submit_timeout(&server->ring, timeout) < 0 && errno != ETIME)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            ERR("io_uring_enter");
+        }
+        stats_add(&server->stats.wakeups, 1);
+
+        struct io_uring_cqe *head;
+        while (atomic_load_explicit(&server->chat->running, memory_order_relaxed) &&
+               (head = uring_peek(&server->ring)) != NULL)
+        {
+            struct io_uring_cqe cqe = *head;
+            uring_advance(&server->ring);
+            if (cqe.user_data == URING_IGNORE)
+                continue;
+            uintptr_t kind = (uintptr_t)cqe.user_data & URING_KIND_MASK;
+            client_t *client = (client_t *)((uintptr_t)cqe.user_data & ~URING_KIND_MASK);
+            int more = cqe.flags & IORING_CQE_F_MORE;
+            if (client == &listener || client == &local_listener)
+            {
+                if (cqe.res >= 0)
+                    server_uring_accept(server, client, cqe.res);
+                else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED && cqe.res != -ECONNABORTED)
+                {
+                    errno = -cqe.res;
+                    ERR("accept");
+                }
+                if (!more && server->listening)
+                    uring_prep_accept_multishot(server_sqe(server), client->fd, (uintptr_t)client);
+                continue;
+            }
+            if (client == &waker)
+            {
+                server_drain_inbox(server);
+                if (server->listening && atomic_load(&server->chat->handoff_step) != server->handoff_step)
+                    server_handoff(server, &listener, &local_listener);
+                if (!more)
+                    uring_prep_poll_multishot(server_sqe(server), waker.fd, (uintptr_t)&waker);
+                continue;
+            }
+            if (client == &ticker)
+            {
+                server_tick(server);
+                if (!more)
+                    uring_prep_poll_multishot(server_sqe(server), ticker.fd, (uintptr_t)&ticker);
+                continue;
+            }
+
+            if (!more)
+                client->inflight--;
+            if (kind == URING_RECV)
+                server_uring_received(server, client, &cqe);
+            else
+                server_uring_sent(server, client, cqe.res);
+            if (client->state == CLIENT_CLOSED && client->inflight == 0)
+                server_release_client(server, client);
+        }
+        timeout = server_resume(server);
+        server_flush_pending(server);
+        client_slab_recycle(&server->clients);
+    }
+    server_shutdown(server);
+}
+
+/*
+ * Answers one admin connection with a snapshot of the counters of all shards,
+ * one "name value" line each, and closes it.
+ */
+void admin_serve(chat_t *chat, int admin_socket)
+{
+    int client_socket = add_new_client(admin_socket);
+    if (client_socket == -1)
+        return;
+
+    stats_snapshot_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < chat->config->thread_count; i++)
+        stats_collect(&chat->servers[i].stats, &total);
+
+    char buffer[ADMIN_SNAPSHOT_SIZE];
+    int length = snprintf(buffer, sizeof(buffer), "clients %d\nshards %d\n", atomic_load(&chat->client_count),
+                          chat->config->thread_count);
+#define X(name) length += snprintf(buffer + length, sizeof(buffer) - length, #name " %ld\n", total.name);
+    SERVER_STATS(X)
+#undef X
+    length += snprintf(buffer + length, sizeof(buffer) - length, "max_queue_bytes %ld\n", total.max_queue_bytes);
+
+    if (bulk_write(client_socket, buffer, length) < 0 && errno != EPIPE)
+        ERR("bulk_write");
+    if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
+        ERR("close");
+}
+
+// Runs a step of the handoff on every shard and waits until all of them are through.
+void handoff_run_step(chat_t *chat, int stop)
+{
+    chat->handoff_stop = stop;
+    atomic_fetch_add(&chat->handoff_step, 1);
+    for (int i = 0; i < chat->config->thread_count; i++)
+        server_wakeup(&chat->servers[i]);
+    for (int i = 0; i < chat->config->thread_count; i++)
+    {
+        uint64_t done;
+        if (TEMP_FAILURE_RETRY(read(chat->handoff_done, &done, sizeof(done))) < 0)
+            ERR("read");
+    }
+}
+
+int handoff_fail(int connection, const char *reason)
+{
+    log_write(LOG_ERROR, "Server: Handoff failed: %s, still serving.", reason);
+    if (TEMP_FAILURE_RETRY(close(connection)) < 0)
+        ERR("close");
+    return -1;
+}
+
+/*
+ * Hands the sockets over to the server connected to the handoff socket. A
+ * failed handoff leaves the server running. Returns 0 once it is draining.
+ */
+int handoff_serve(chat_t *chat, int *handoff_listener)
+{
+    int connection = add_new_client(*handoff_listener);
+    if (connection == -1)
+        return -1;
+    handoff_record_t record;
+    int fd;
+    if (handoff_receive(connection, &record, &fd) <= 0 || record.type != HANDOFF_REQUEST)
+    {
+        if (fd != -1 && TEMP_FAILURE_RETRY(close(fd)) < 0)
+            ERR("close");
+        return handoff_fail(connection, "malformed request");
+    }
+    if (fd != -1 && TEMP_FAILURE_RETRY(close(fd)) < 0)
+        ERR("close");
+    int handoff_clients = record.flags;
+    // Clients have requests in flight on the ring, only the epoll shards can let go of them.
+    if (handoff_clients && chat->config->backend == BACKEND_URING)
+    {
+        log_write(LOG_WARNING, "Server: The io_uring backend does not hand over clients, they stay until they leave.");
+        handoff_clients = 0;
+    }
+
+    memset(&record, 0, offsetof(handoff_record_t, in));
+    record.type = HANDOFF_LISTENER;
+    for (int i = 0; i < chat->config->thread_count; i++)
+    {
+        if (handoff_send(connection, &record, chat->servers[i].server_socket) < 0)
+            return handoff_fail(connection, strerror(errno));
+    }
+    record.type = HANDOFF_LOCAL_LISTENER;
+    if (chat->local_socket != -1 && handoff_send(connection, &record, chat->local_socket) < 0)
+        return handoff_fail(connection, strerror(errno));
+
+    // The shards send their clients themselves, each record is a single message.
+    chat->handoff_socket = connection;
+    chat->handoff_clients = handoff_clients;
+    atomic_store(&chat->handoff_failed, 0);
+    if (handoff_clients)
+        handoff_run_step(chat, 0);
+    chat->handoff_socket = -1;
+    if (atomic_load(&chat->handoff_failed))
+        return handoff_fail(connection, "cannot send the clients");
+
+    // The successor offers its own handoff socket at the same path once it is over.
+    if (TEMP_FAILURE_RETRY(close(*handoff_listener)) < 0)
+        ERR("close");
+    if (unlink(chat->config->handoff_path) < 0 && errno != ENOENT)
+        ERR("unlink");
+    *handoff_listener = -1;
+    record.type = HANDOFF_END;
+    record.flags = handoff_clients;
+    record.id = atomic_load(&chat->next_id);
+    if (handoff_send(connection, &record, -1) < 0 || handoff_receive(connection, &record, &fd) <= 0 ||
+        record.type != HANDOFF_END)
+    {
+        if (fd != -1 && TEMP_FAILURE_RETRY(close(fd)) < 0)
+            ERR("close");
+        *handoff_listener = handoff_listen(chat->config->handoff_path);
+        sop_setnonblock(*handoff_listener);
+        return handoff_fail(connection, "the successor did not confirm");
+    }
+    if (TEMP_FAILURE_RETRY(close(connection)) < 0)
+        ERR("close");
+    handoff_run_step(chat, 1);
+    chat->draining = 1;
+    log_write(LOG_INFO, "Server: Handed over, %d clients left to drain.", atomic_load(&chat->client_count));
+    return 0;
+}
+
+/*
+ * Connects to the handoff socket of the running server and receives its
+ * listening sockets, and its clients with --takeover-clients. The new server
+ * runs as many shards as the old one had, one per listening socket.
+ */
+void takeover_receive(server_config_t *config, takeover_t *takeover)
+{
+    int connection = handoff_connect(config->takeover_path);
+    handoff_record_t record;
+    memset(&record, 0, offsetof(handoff_record_t, in));
+    record.type = HANDOFF_REQUEST;
+    record.flags = config->takeover_clients;
+    if (handoff_send(connection, &record, -1) < 0)
+        ERR("sendmsg");
+
+    // Descriptors arrive before the final client limit is known, the limit grows along.
+    long reserved = config->max_clients + 16;
+    for (;;)
+    {
+        if (takeover->listener_count + takeover->client_count + 16 >= reserved)
+            reserved = raise_fd_limit(2 * reserved);
+        int fd;
+        int ret = handoff_receive(connection, &record, &fd);
+        if (ret < 0)
+            ERR("recvmsg");
+        if (ret == 0)
+        {
+            fprintf(stderr, "Server: %s hung up before the handoff was over.\n", config->takeover_path);
+            exit(EXIT_FAILURE);
+        }
+        if (record.type == HANDOFF_END)
+        {
+            if (handoff_send(connection, &record, -1) < 0)
+                ERR("sendmsg");
+            takeover->next_id = record.id;
+            if (config->takeover_clients && !record.flags)
+                fprintf(stderr, "Server: %s kept its clients, they stay there until they leave.\n",
+                        config->takeover_path);
+            break;
+        }
+        if (fd == -1 || (record.type == HANDOFF_LISTENER && takeover->listener_count == MAX_THREAD_COUNT) ||
+            (record.type == HANDOFF_LOCAL_LISTENER && takeover->local_listener != -1) ||
+            (record.type != HANDOFF_LISTENER && record.type != HANDOFF_LOCAL_LISTENER && record.type != HANDOFF_CLIENT))
+        {
+            fprintf(stderr, "Server: Malformed handoff from %s.\n", config->takeover_path);
+            exit(EXIT_FAILURE);
+        }
+        if (record.type == HANDOFF_LISTENER)
+        {
+            takeover->listeners[takeover->listener_count++] = fd;
+            continue;
+        }
+        if (record.type == HANDOFF_LOCAL_LISTENER)
+        {
+            takeover->local_listener = fd;
+            continue;
+        }
+        size_t size = offsetof(adopted_client_t, record) + offsetof(handoff_record_t, in) + record.in_len;
+        adopted_client_t *adopted = malloc(size);
+        if (adopted == NULL)
+            ERR("malloc");
+        memcpy(&adopted->record, &record, offsetof(handoff_record_t, in) + record.in_len);
+        adopted->fd = fd;
+        adopted->next = takeover->clients;
+        takeover->clients = adopted;
+        takeover->client_count++;
+    }
+    if (TEMP_FAILURE_RETRY(close(connection)) < 0)
+        ERR("close");
+    if (takeover->listener_count == 0)
+    {
+        fprintf(stderr, "Server: %s handed over no listening socket.\n", config->takeover_path);
+        exit(EXIT_FAILURE);
+    }
+
+    config->thread_count = takeover->listener_count;
+    if (config->max_clients < takeover->client_count)
+        config->max_clients = takeover->client_count;
+    fprintf(stderr, "Server: Took over %d listening sockets and %d clients, threads = %d, max clients = %d\n",
+            takeover->listener_count, takeover->client_count, config->thread_count, config->max_clients);
+}
+
+/*
+ * The key table of the key file, or of the single key from the command line
+ * which belongs to DEFAULT_TENANT.
+ */
+key_table_t *keys_load(server_config_t *config)
+{
+    char error[KEYS_ERROR_SIZE];
+    if (config->keys_path != NULL)
+    {
+        key_table_t *table = key_table_load(config->keys_path, error, sizeof(error));
+        if (table == NULL)
+        {
+            fprintf(stderr, "Server: Cannot load keys from %s: %s\n", config->keys_path, error);
+            exit(EXIT_FAILURE);
+        }
+        return table;
+    }
+
+    key_table_t *table = key_table_create(1);
+    if (key_table_add(table, DEFAULT_TENANT, config->key, error, sizeof(error)) < 0)
+    {
+        fprintf(stderr, "Server: Cannot use the key: %s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    return table;
+}
+
+/*
+ * Swaps in a new table, the old one is freed once every shard has been seen
+ * outside of a lookup. A broken file leaves the current keys in place.
+ */
+void keys_reload(chat_t *chat)
+{
+    char error[KEYS_ERROR_SIZE];
+    if (chat->config->keys_path == NULL)
+    {
+        log_write(LOG_WARNING, "Server: SIGHUP ignored, there is no key file to reload.");
+        return;
+    }
+    key_table_t *table = key_table_load(chat->config->keys_path, error, sizeof(error));
+    if (table == NULL)
+    {
+        log_write(LOG_ERROR, "Server: Keys not reloaded from %s: %s", chat->config->keys_path, error);
+        return;
+    }
+
+    key_table_t *old = atomic_exchange(&chat->keys, table);
+    for (int i = 0; i < chat->config->thread_count; i++)
+    {
+        while (atomic_load(&chat->servers[i].reading_keys))
+            sched_yield();
+    }
+    key_table_free(old);
+    log_write(LOG_INFO, "Server: %d keys reloaded from %s", table->count, chat->config->keys_path);
+}
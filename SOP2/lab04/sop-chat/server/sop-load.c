@@ -0,0 +1,533 @@
+#include "socket-utils.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "chat.h"
+
+#define LOAD_NAME "load"
+#define MAX_EVENTS 64
+#define TICK_NS 1000000L
+#define DRAIN_TIMEOUT_MS 2000
+#define IN_SIZE (8 * BUFF_SIZE)
+
+// Log-linear histogram: exact below 2^HISTOGRAM_BITS us, then 2^HISTOGRAM_BITS buckets per power of two.
+#define HISTOGRAM_BITS 6
+#define HISTOGRAM_SIZE ((64 - HISTOGRAM_BITS + 1) << HISTOGRAM_BITS)
+
+#define ELAPSED_US(start, end) (((end).tv_sec - (start).tv_sec) * 1000000.0 + ((end).tv_nsec - (start).tv_nsec) / 1000.0)
+
+typedef struct load_config_t
+{
+    char *host;
+    char *port;
+    char *key;
+    // The first local_clients clients connect to the Unix socket at local_path instead.
+    char *local_path;
+    int local_clients;
+    int clients;
+    int senders;
+    int rooms;
+    double rate;
+    int duration;
+    int framed;
+} load_config_t;
+
+typedef struct connection_t
+{
+    int fd;
+    int framed;
+    char in[IN_SIZE];
+    int in_len;
+    char out[BUFF_SIZE];
+    int out_len;
+    int out_offset;
+    int waiting;
+} connection_t;
+
+typedef struct load_t
+{
+    load_config_t *config;
+    connection_t *connections;
+    int epoll_descriptor;
+    int next_sender;
+    long sent;
+    long skipped;
+    long received;
+    uint64_t histogram[HISTOGRAM_SIZE];
+    uint64_t max_latency;
+} load_t;
+
+void usage(char *pname);
+void parse_argv(int argc, char **argv, load_config_t *config);
+void load_connect(load_t *load, connection_t *connection, int index);
+void load_encode(connection_t *connection, const char *text);
+void load_flush(load_t *load, connection_t *connection);
+void load_tick(load_t *load, double elapsed);
+void load_read(load_t *load, connection_t *connection);
+void load_record(load_t *load, const char *text, size_t size);
+void load_run(load_t *load);
+void load_report(load_t *load, double elapsed);
+int histogram_index(uint64_t value);
+uint64_t histogram_value(int index);
+uint64_t histogram_percentile(load_t *load, double percentile);
+
+int main(int argc, char **argv)
+{
+    load_config_t config;
+    parse_argv(argc, argv, &config);
+
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("sethandler");
+    if (raise_fd_limit(config.clients + 16) < config.clients + 16)
+    {
+        fprintf(stderr, "Load: Descriptor limit is too low for %d connections.\n", config.clients);
+        exit(EXIT_FAILURE);
+    }
+
+    load_t *load = calloc(1, sizeof(load_t));
+    if (load == NULL)
+        ERR("calloc");
+    load->config = &config;
+    if ((load->connections = calloc(config.clients, sizeof(connection_t))) == NULL)
+        ERR("calloc");
+    if ((load->epoll_descriptor = epoll_create1(0)) < 0)
+        ERR("epoll_create1");
+
+    int framed = 0;
+    for (int i = 0; i < config.clients; i++)
+    {
+        load_connect(load, &load->connections[i], i);
+        framed += load->connections[i].framed;
+    }
+    if (config.framed && framed < config.clients)
+        fprintf(stderr, "Load: %d of %d connections fell back to fixed-size frames.\n", config.clients - framed,
+                config.clients);
+    // Joins are not acknowledged, give the server a moment to process them.
+    if (config.rooms > 1)
+        usleep(500000);
+
+    printf("Load: %d clients in %d rooms, %d senders, %.0f messages/s for %d s, %s\n", config.clients, config.rooms,
+           config.senders, config.rate, config.duration, framed == config.clients ? "framed" : "fixed-size frames");
+    if (config.local_clients > 0)
+        printf("Load: %d of them connected to %s\n", config.local_clients, config.local_path);
+    load_run(load);
+
+    for (int i = 0; i < config.clients; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(load->connections[i].fd)) < 0)
+            ERR("close");
+    }
+    if (TEMP_FAILURE_RETRY(close(load->epoll_descriptor)) < 0)
+        ERR("close");
+    free(load->connections);
+    free(load);
+    return EXIT_SUCCESS;
+}
+
+void usage(char *pname)
+{
+    fprintf(stderr,
+            "USAGE: %s [--clients N] [--senders N] [--rooms N] [--rate MESSAGES_PER_S] [--duration S] [--framed]\n"
+            "          [--unix PATH [--local N]] host port key\n",
+            pname);
+    exit(EXIT_FAILURE);
+}
+
+void parse_argv(int argc, char **argv, load_config_t *config)
+{
+    static struct option options[] = {
+        {"clients", required_argument, NULL, 'c'},
+        {"senders", required_argument, NULL, 's'},
+        {"rooms", required_argument, NULL, 'r'},
+        {"rate", required_argument, NULL, 'R'},
+        {"duration", required_argument, NULL, 'd'},
+        {"framed", no_argument, NULL, 'f'},
+        {"unix", required_argument, NULL, 'u'},
+        {"local", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->clients = 100;
+    config->senders = 0;
+    config->rooms = 1;
+    config->rate = 1000;
+    config->duration = 10;
+    config->framed = 0;
+    config->local_path = NULL;
+    config->local_clients = -1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:s:r:R:d:fu:l:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (sscanf(optarg, "%d", &config->clients) != 1 || config->clients < 2)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if (sscanf(optarg, "%d", &config->senders) != 1 || config->senders <= 0)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d", &config->rooms) != 1 || config->rooms <= 0)
+                    usage(argv[0]);
+                break;
+            case 'R':
+                if (sscanf(optarg, "%lf", &config->rate) != 1 || config->rate <= 0)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                if (sscanf(optarg, "%d", &config->duration) != 1 || config->duration <= 0)
+                    usage(argv[0]);
+                break;
+            case 'f':
+                config->framed = 1;
+                break;
+            case 'u':
+                config->local_path = optarg;
+                break;
+            case 'l':
+                if (sscanf(optarg, "%d", &config->local_clients) != 1 || config->local_clients < 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 3)
+        usage(argv[0]);
+    config->host = argv[optind];
+    config->port = argv[optind + 1];
+    config->key = argv[optind + 2];
+    // Every client sends by default, each room needs someone to hear its sender.
+    if (config->senders == 0 || config->senders > config->clients)
+        config->senders = config->clients;
+    if (config->clients < 2 * config->rooms)
+        usage(argv[0]);
+    // Every client goes through the Unix socket by default.
+    if (config->local_path == NULL)
+        config->local_clients = 0;
+    else if (config->local_clients == -1 || config->local_clients > config->clients)
+        config->local_clients = config->clients;
+}
+
+/*
+ * Connects and authorizes a client with blocking calls, moves it to its
+ * room and only then makes it non-blocking and hands it to the event loop.
+ */
+void load_connect(load_t *load, connection_t *connection, int index)
+{
+    load_config_t *config = load->config;
+    char buffer[BUFF_SIZE];
+    memset(buffer, 0, BUFF_SIZE);
+    strncpy(buffer + NAME_OFFSET, LOAD_NAME, NAME_SIZE - 1);
+    strncpy(buffer + MESSAGE_OFFSET, config->key, FRAMED_MAGIC_OFFSET - MESSAGE_OFFSET - 1);
+    if (config->framed)
+        memcpy(buffer + FRAMED_MAGIC_OFFSET, FRAMED_REQUEST, FRAMED_MAGIC_SIZE);
+
+    if (index < config->local_clients)
+        connection->fd = connect_local_socket(config->local_path);
+    else
+        connection->fd = connect_tcp_socket(config->host, config->port);
+    if (bulk_write(connection->fd, buffer, BUFF_SIZE) < 0)
+        ERR("bulk_write");
+    if (bulk_read(connection->fd, buffer, BUFF_SIZE) < BUFF_SIZE)
+    {
+        fprintf(stderr, "Load: Server rejected connection %d.\n", index);
+        exit(EXIT_FAILURE);
+    }
+    connection->framed = memcmp(buffer + FRAMED_MAGIC_OFFSET, FRAMED_ACCEPT, FRAMED_MAGIC_SIZE) == 0;
+    connection->in_len = 0;
+    connection->out_len = 0;
+    connection->out_offset = 0;
+    connection->waiting = 0;
+
+    if (config->rooms > 1)
+    {
+        char command[NAME_SIZE];
+        snprintf(command, NAME_SIZE, "/join load%d", index % config->rooms);
+        load_encode(connection, command);
+        if (bulk_write(connection->fd, connection->out, connection->out_len) < 0)
+            ERR("bulk_write");
+        connection->out_len = 0;
+    }
+
+    int flags = fcntl(connection->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(connection->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        ERR("fcntl");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(load->epoll_descriptor, EPOLL_CTL_ADD, connection->fd, &event) == -1)
+        ERR("epoll_ctl");
+}
+
+/*
+ * Encodes the message into the connection's output buffer, the caller writes it.
+ */
+void load_encode(connection_t *connection, const char *text)
+{
+    size_t size = strlen(text);
+    if (connection->framed)
+    {
+        uint16_t length = htons((uint16_t)size);
+        memcpy(connection->out, &length, sizeof(length));
+        connection->out[2] = FRAME_MESSAGE;
+        memcpy(connection->out + FRAME_HEADER_SIZE, text, size);
+        connection->out_len = FRAME_HEADER_SIZE + size;
+    }
+    else
+    {
+        memset(connection->out, 0, BUFF_SIZE);
+        strncpy(connection->out + NAME_OFFSET, LOAD_NAME, NAME_SIZE - 1);
+        strncpy(connection->out + MESSAGE_OFFSET, text, MESSAGE_SIZE - 1);
+        connection->out_len = BUFF_SIZE;
+    }
+    connection->out_offset = 0;
+}
+
+/*
+ * Writes what is left of the connection's message, EPOLLOUT is requested
+ * only while a partial message is waiting.
+ */
+void load_flush(load_t *load, connection_t *connection)
+{
+    ssize_t ret = TEMP_FAILURE_RETRY(
+        write(connection->fd, connection->out + connection->out_offset, connection->out_len - connection->out_offset));
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        ERR("write");
+    if (ret > 0)
+        connection->out_offset += ret;
+
+    int waiting = connection->out_offset < connection->out_len;
+    if (!waiting)
+        connection->out_len = connection->out_offset = 0;
+    if (waiting == connection->waiting)
+        return;
+
+    struct epoll_event event;
+    event.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(load->epoll_descriptor, EPOLL_CTL_MOD, connection->fd, &event) == -1)
+        ERR("epoll_ctl");
+    connection->waiting = waiting;
+}
+
+/*
+ * Sends as many messages as the rate allows by now, round robin over the
+ * senders. A sender still busy with its previous message skips its turn,
+ * which is reported, as the offered load was not reached then.
+ */
+void load_tick(load_t *load, double elapsed)
+{
+    long due = (long)(load->config->rate * elapsed) - load->sent - load->skipped;
+    for (; due > 0; due--)
+    {
+        connection_t *connection = &load->connections[load->next_sender];
+        load->next_sender = (load->next_sender + 1) % load->config->senders;
+        if (connection->out_len > 0)
+        {
+            load->skipped++;
+            continue;
+        }
+
+        struct timespec now;
+        char text[64];
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        snprintf(text, sizeof(text), "%ld.%09ld", (long)now.tv_sec, now.tv_nsec);
+        load_encode(connection, text);
+        load_flush(load, connection);
+        load->sent++;
+    }
+}
+
+void load_record(load_t *load, const char *text, size_t size)
+{
+    char stamp[64];
+    struct timespec sent, now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (size >= sizeof(stamp))
+        return;
+    memcpy(stamp, text, size);
+    stamp[size] = '\0';
+    if (sscanf(stamp, "%ld.%ld", &sent.tv_sec, &sent.tv_nsec) != 2)
+        return;
+
+    double latency = ELAPSED_US(sent, now);
+    uint64_t value = latency > 0 ? (uint64_t)latency : 0;
+    load->histogram[histogram_index(value)]++;
+    if (value > load->max_latency)
+        load->max_latency = value;
+    load->received++;
+}
+
+void load_read(load_t *load, connection_t *connection)
+{
+    ssize_t ret =
+        TEMP_FAILURE_RETRY(read(connection->fd, connection->in + connection->in_len, IN_SIZE - connection->in_len));
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (ret <= 0)
+    {
+        fprintf(stderr, "Load: Server has closed a connection.\n");
+        exit(EXIT_FAILURE);
+    }
+    connection->in_len += ret;
+
+    int offset = 0;
+    for (;;)
+    {
+        char *frame = connection->in + offset;
+        int available = connection->in_len - offset;
+        if (!connection->framed)
+        {
+            if (available < BUFF_SIZE)
+                break;
+            frame[BUFF_SIZE - 1] = '\0';
+            load_record(load, frame + MESSAGE_OFFSET, strlen(frame + MESSAGE_OFFSET));
+            offset += BUFF_SIZE;
+            continue;
+        }
+
+        uint16_t length;
+        if (available < FRAME_HEADER_SIZE)
+            break;
+        memcpy(&length, frame, sizeof(length));
+        length = ntohs(length);
+        if (available < FRAME_HEADER_SIZE + length)
+            break;
+        if (frame[2] == FRAME_MESSAGE && length >= FRAME_ID_SIZE + FRAME_SEQUENCE_SIZE)
+            load_record(load, frame + FRAME_HEADER_SIZE + FRAME_ID_SIZE + FRAME_SEQUENCE_SIZE,
+                        length - FRAME_ID_SIZE - FRAME_SEQUENCE_SIZE);
+        offset += FRAME_HEADER_SIZE + length;
+    }
+    connection->in_len -= offset;
+    memmove(connection->in, connection->in + offset, connection->in_len);
+}
+
+/*
+ * Sends for the configured time, then keeps receiving until nothing
+ * has arrived for DRAIN_TIMEOUT_MS.
+ */
+void load_run(load_t *load)
+{
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer < 0)
+        ERR("timerfd_create");
+    struct itimerspec tick;
+    memset(&tick, 0, sizeof(tick));
+    tick.it_value.tv_nsec = TICK_NS;
+    tick.it_interval.tv_nsec = TICK_NS;
+    if (timerfd_settime(timer, 0, &tick, NULL))
+        ERR("timerfd_settime");
+    struct epoll_event event, events[MAX_EVENTS];
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(load->epoll_descriptor, EPOLL_CTL_ADD, timer, &event) == -1)
+        ERR("epoll_ctl");
+
+    struct timespec start, now, last;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    int sending = 1;
+    for (;;)
+    {
+        int nfds = TEMP_FAILURE_RETRY(epoll_wait(load->epoll_descriptor, events, MAX_EVENTS,
+                                                 sending ? -1 : DRAIN_TIMEOUT_MS));
+        if (nfds < 0)
+            ERR("epoll_wait");
+        if (nfds == 0)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < nfds; i++)
+        {
+            connection_t *connection = events[i].data.ptr;
+            if (connection == NULL)
+            {
+                uint64_t expirations;
+                if (TEMP_FAILURE_RETRY(read(timer, &expirations, sizeof(expirations))) < 0 && errno != EAGAIN)
+                    ERR("read");
+                double elapsed = ELAPSED_US(start, now) / 1000000.0;
+                if (elapsed >= load->config->duration)
+                {
+                    sending = 0;
+                    if (epoll_ctl(load->epoll_descriptor, EPOLL_CTL_DEL, timer, NULL) == -1)
+                        ERR("epoll_ctl");
+                    continue;
+                }
+                load_tick(load, elapsed);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+                load_flush(load, connection);
+            if (events[i].events & EPOLLIN)
+            {
+                load_read(load, connection);
+                last = now;
+            }
+        }
+    }
+    if (TEMP_FAILURE_RETRY(close(timer)) < 0)
+        ERR("close");
+
+    load_report(load, ELAPSED_US(start, last) / 1000000.0);
+}
+
+void load_report(load_t *load, double elapsed)
+{
+    load_config_t *config = load->config;
+    // Clients are spread round robin, every message reaches the other members of its sender's room.
+    long expected = 0;
+    for (int i = 0; i < config->senders; i++)
+    {
+        int members = config->clients / config->rooms + (i % config->rooms < config->clients % config->rooms);
+        expected += members - 1;
+    }
+    expected = (long)((double)expected / config->senders * load->sent);
+
+    printf("Sent %ld messages (%ld skipped by busy senders), received %ld of about %ld deliveries\n", load->sent,
+           load->skipped, load->received, expected);
+    printf("Throughput: %.0f messages/s sent, %.0f deliveries/s received\n", load->sent / (double)config->duration,
+           load->received / elapsed);
+    if (load->received > 0)
+        printf("Latency [us]: p50 %lu, p99 %lu, p999 %lu, max %lu\n", histogram_percentile(load, 0.5),
+               histogram_percentile(load, 0.99), histogram_percentile(load, 0.999), load->max_latency);
+}
+
+int histogram_index(uint64_t value)
+{
+    if (value < (1u << HISTOGRAM_BITS))
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value) - HISTOGRAM_BITS;
+    return ((exponent + 1) << HISTOGRAM_BITS) + (int)(value >> exponent) - (1 << HISTOGRAM_BITS);
+}
+
+/*
+ * The upper bound of the bucket, so percentiles are never underestimated.
+ */
+uint64_t histogram_value(int index)
+{
+    if (index < (2 << HISTOGRAM_BITS))
+        return index;
+    int exponent = (index >> HISTOGRAM_BITS) - 1;
+    uint64_t mantissa = (index & ((1 << HISTOGRAM_BITS) - 1)) + (1 << HISTOGRAM_BITS);
+    return ((mantissa + 1) << exponent) - 1;
+}
+
+uint64_t histogram_percentile(load_t *load, double percentile)
+{
+    uint64_t target = (uint64_t)(percentile * load->received);
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++)
+    {
+        count += load->histogram[i];
+        if (count > target)
+            return histogram_value(i);
+    }
+    return load->max_latency;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdatomic.h>
+
+/*
+ * Counters kept by every shard. rejected covers a full server, a wrong key
+ * and a handshake timeout, deferred counts clients over their frame budget,
+ * syscalls counts what the event loop itself made.
+ */
+#define SERVER_STATS(X) \
+    X(accepted)         \
+    X(accepted_local)   \
+    X(rejected)         \
+    X(disconnected)     \
+    X(timed_out)        \
+    X(handed_off)       \
+    X(deferred)         \
+    X(throttled)        \
+    X(rate_dropped)     \
+    X(messages_in)      \
+    X(messages_out)     \
+    X(bytes_out)        \
+    X(write_calls)      \
+    X(wakeups)          \
+    X(syscalls)         \
+    X(dropped)          \
+    X(queued_bytes)     \
+    X(queued_messages)
+
+// Only the owning shard writes, with a relaxed load and store, readers may lag a few updates.
+typedef struct server_stats_t
+{
+#define X(name) atomic_long name;
+    SERVER_STATS(X)
+#undef X
+    // Deepest single send queue seen, in bytes.
+    atomic_long max_queue_bytes;
+} server_stats_t;
+
+typedef struct stats_snapshot_t
+{
+#define X(name) long name;
+    SERVER_STATS(X)
+#undef X
+    long max_queue_bytes;
+} stats_snapshot_t;
+
+static inline void stats_add(atomic_long *counter, long value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void stats_max(atomic_long *counter, long value)
+{
+    if (value > atomic_load_explicit(counter, memory_order_relaxed))
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void stats_init(server_stats_t *stats)
+{
+#define X(name) atomic_init(&stats->name, 0);
+    SERVER_STATS(X)
+#undef X
+    atomic_init(&stats->max_queue_bytes, 0);
+}
+
+/*
+ * Adds the shard's counters to the snapshot, which starts zeroed.
+ */
+static inline void stats_collect(const server_stats_t *stats, stats_snapshot_t *snapshot)
+{
+#define X(name) snapshot->name += atomic_load_explicit(&stats->name, memory_order_relaxed);
+    SERVER_STATS(X)
+#undef X
+    long max_queue_bytes = atomic_load_explicit(&stats->max_queue_bytes, memory_order_relaxed);
+    if (max_queue_bytes > snapshot->max_queue_bytes)
+        snapshot->max_queue_bytes = max_queue_bytes;
+}
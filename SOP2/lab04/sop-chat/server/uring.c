@@ -0,0 +1,246 @@
+#include "uring.h"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The rings are shared with the kernel, which is not C11 code, hence the builtins.
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Room for the completions of several multishot requests per submitted SQE.
+#define URING_CQ_FACTOR 4
+
+static int uring_setup(unsigned entries, struct io_uring_params *params, unsigned flags)
+{
+    memset(params, 0, sizeof(*params));
+    params->flags = flags | IORING_SETUP_CQSIZE;
+    params->cq_entries = URING_CQ_FACTOR * entries;
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    // Only the shard thread submits, which older kernels cannot be told.
+    if ((ring->fd = uring_setup(entries, &params, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN)) < 0 &&
+        errno == EINVAL)
+        ring->fd = uring_setup(entries, &params, 0);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring =
+        mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        ERR("mmap");
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size > 0)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            ERR("mmap");
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        ERR("mmap");
+
+    char *sq = ring->sq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+    // SQE slots are used in ring order, the indirection array is the identity.
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    // Closing the ring cancels whatever is still in flight.
+    if (TEMP_FAILURE_RETRY(close(ring->fd)) < 0)
+        ERR("close");
+    if (ring->buffer_ring != NULL && munmap(ring->buffer_ring, ring->buffer_ring_size))
+        ERR("munmap");
+    free(ring->buffers);
+    if (munmap(ring->sqes, ring->sqes_size))
+        ERR("munmap");
+    if (ring->cq_ring_size > 0 && munmap(ring->cq_ring, ring->cq_ring_size))
+        ERR("munmap");
+    if (munmap(ring->sq_ring, ring->sq_ring_size))
+        ERR("munmap");
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+ * Registers count buffers of the given size as buffer group group.
+ * The count must be a power of two.
+ */
+void uring_buffers_init(uring_t *ring, unsigned count, unsigned size, uint16_t group)
+{
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+    ring->buffer_group = group;
+    ring->buffer_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED)
+        ERR("mmap");
+    if ((ring->buffers = malloc((size_t)count * size)) == NULL)
+        ERR("malloc");
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buffer_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        ERR("io_uring_register");
+
+    ring->buffer_ring->tail = 0;
+    for (unsigned i = 0; i < count; i++)
+        uring_buffer_recycle(ring, (uint16_t)i);
+}
+
+char *uring_buffer(uring_t *ring, uint16_t id)
+{
+    return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+// Gives the buffer back to the kernel, its contents must not be used anymore.
+void uring_buffer_recycle(uring_t *ring, uint16_t id)
+{
+    uint16_t tail = ring->buffer_ring->tail;
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[tail & (ring->buffer_count - 1)];
+    buffer->addr = (uintptr_t)uring_buffer(ring, id);
+    buffer->len = ring->buffer_size;
+    buffer->bid = id;
+    STORE_RELEASE(&ring->buffer_ring->tail, (uint16_t)(tail + 1));
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - LOAD_ACQUIRE(ring->sq_head) >= ring->sq_entries)
+        return NULL;
+    ring->sq_pending++;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned uring_sqe_index(uring_t *ring, struct io_uring_sqe *sqe)
+{
+    return (unsigned)(sqe - ring->sqes);
+}
+
+/*
+ * Returns the result of io_uring_enter. The kernel copies everything an SQE
+ * points to during the call (IORING_FEAT_SUBMIT_STABLE), except for the data
+ * buffers themselves.
+ */
+int uring_submit(uring_t *ring, unsigned wait_count)
+{
+    unsigned count = ring->sq_pending;
+    STORE_RELEASE(ring->sq_tail, *ring->sq_tail + count);
+    ring->sq_pending = 0;
+    return (int)syscall(__NR_io_uring_enter, ring->fd, count, wait_count, wait_count ? IORING_ENTER_GETEVENTS : 0,
+                        NULL, 0);
+}
+
+int uring_submit_timeout(uring_t *ring, int timeout_ms)
+{
+    if (timeout_ms <= 0)
+        return uring_submit(ring, timeout_ms < 0 ? 1 : 0);
+    struct __kernel_timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&timeout;
+    unsigned count = ring->sq_pending;
+    STORE_RELEASE(ring->sq_tail, *ring->sq_tail + count);
+    ring->sq_pending = 0;
+    return (int)syscall(__NR_io_uring_enter, ring->fd, count, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                        sizeof(arg));
+}
+
+struct io_uring_cqe *uring_peek(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == LOAD_ACQUIRE(ring->cq_tail))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_advance(uring_t *ring)
+{
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, int count, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = count;
+    // Sockets have no file position, -1 means the current one.
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
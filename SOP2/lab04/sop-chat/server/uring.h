@@ -0,0 +1,80 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "chat.h"
+
+/*
+ * Just enough of io_uring on the raw system calls. Receives use provided
+ * buffers, so an idle connection pins no memory.
+ */
+typedef struct uring_t
+{
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+    unsigned buffer_count;
+    unsigned buffer_size;
+    uint16_t buffer_group;
+} uring_t;
+
+// Returns -1 and sets errno when the kernel does not offer io_uring.
+int uring_init(uring_t *ring, unsigned entries);
+
+void uring_destroy(uring_t *ring);
+
+void uring_buffers_init(uring_t *ring, unsigned count, unsigned size, uint16_t group);
+
+char *uring_buffer(uring_t *ring, uint16_t id);
+
+void uring_buffer_recycle(uring_t *ring, uint16_t id);
+
+// Returns NULL when the submission ring is full, uring_submit makes room.
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+unsigned uring_sqe_index(uring_t *ring, struct io_uring_sqe *sqe);
+
+// Submits the queued SQEs and waits for at least wait_count completions.
+int uring_submit(uring_t *ring, unsigned wait_count);
+
+/*
+ * Submits the queued SQEs and waits for a completion for at most timeout_ms
+ * milliseconds, -1 meaning no limit. Fails with ETIME when the time is up.
+ */
+int uring_submit_timeout(uring_t *ring, int timeout_ms);
+
+struct io_uring_cqe *uring_peek(uring_t *ring);
+
+void uring_advance(uring_t *ring);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data);
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, int count, uint64_t user_data);
+
+// Cancels the request submitted with target as its user data.
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data);
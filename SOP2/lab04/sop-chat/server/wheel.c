@@ -0,0 +1,74 @@
+#include "wheel.h"
+
+#include <stddef.h>
+
+// Every slot is the sentinel of a circular list, an empty one points at itself.
+void wheel_init(timing_wheel_t *wheel)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+    {
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->now = 0;
+    wheel->count = 0;
+}
+
+void wheel_timer_init(wheel_timer_t *timer)
+{
+    timer->expires = 0;
+    timer->pending = 0;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+static void wheel_unlink(wheel_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+void wheel_add(timing_wheel_t *wheel, wheel_timer_t *timer, uint64_t ticks)
+{
+    if (timer->pending)
+        wheel_unlink(timer);
+    else
+        wheel->count++;
+
+    timer->pending = 1;
+    timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+    wheel_timer_t *slot = &wheel->slots[timer->expires % WHEEL_SLOTS];
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+
+void wheel_remove(timing_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer->pending)
+        return;
+    wheel_unlink(timer);
+    timer->pending = 0;
+    wheel->count--;
+}
+
+wheel_timer_t *wheel_advance(timing_wheel_t *wheel)
+{
+    wheel->now++;
+    wheel_timer_t *slot = &wheel->slots[wheel->now % WHEEL_SLOTS];
+    wheel_timer_t *expired = NULL;
+    wheel_timer_t *next;
+    for (wheel_timer_t *timer = slot->next; timer != slot; timer = next)
+    {
+        next = timer->next;
+        if (timer->expires > wheel->now)
+            continue;
+        wheel_remove(wheel, timer);
+        timer->next = expired;
+        expired = timer;
+    }
+    return expired;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#define WHEEL_SLOTS 512
+
+typedef struct wheel_timer_t
+{
+    uint64_t expires;
+    int pending;
+    struct wheel_timer_t *prev;
+    struct wheel_timer_t *next;
+} wheel_timer_t;
+
+// Hashed timing wheel: a timer due at tick t waits in slot t % WHEEL_SLOTS.
+typedef struct timing_wheel_t
+{
+    wheel_timer_t slots[WHEEL_SLOTS];
+    uint64_t now;
+    int count;
+} timing_wheel_t;
+
+void wheel_init(timing_wheel_t *wheel);
+
+void wheel_timer_init(wheel_timer_t *timer);
+
+// Starts or restarts the timer, it expires after ticks ticks (at least one).
+void wheel_add(timing_wheel_t *wheel, wheel_timer_t *timer, uint64_t ticks);
+
+void wheel_remove(timing_wheel_t *wheel, wheel_timer_t *timer);
+
+// Moves one tick forward and returns the expired timers chained through next.
+wheel_timer_t *wheel_advance(timing_wheel_t *wheel);
@@ -0,0 +1,373 @@
+#include "sop-socket.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_EVENTS 256
+#define MAX_PIPELINE 64
+#define MAX_THREADS 64
+
+#define ELAPSED_S(start, end) ((end).tv_sec - (start).tv_sec + ((end).tv_nsec - (start).tv_nsec) / 1e9)
+
+typedef struct bench_config_t
+{
+    char *host;
+    char *port;
+    int connections;
+    long count;
+    int depth;
+    // Records per batch frame, 0 sends them one by one.
+    int batch;
+    int thread_count;
+} bench_config_t;
+
+typedef struct bench_connection_t
+{
+    int fd;
+    long sent;
+    long received;
+    // Room for the whole window, sized by bench_buffers.
+    char *in;
+    size_t in_size;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_offset;
+    // Set while the requests wait for EPOLLOUT.
+    int waiting;
+} bench_connection_t;
+
+/*
+ * Every thread connects its share of the connections and drives them
+ * from its own epoll. The requests start once all threads are connected.
+ */
+typedef struct bench_thread_t
+{
+    pthread_t tid;
+    bench_config_t *config;
+    bench_connection_t *connections;
+    int connection_count;
+    pthread_barrier_t *connected;
+} bench_thread_t;
+
+void usage(char *pname);
+void parse_argv(int argc, char **argv, bench_config_t *config);
+int16_t digit_sum(long value);
+long request_value(bench_connection_t *connection, long index);
+void bench_buffers(bench_config_t *config, bench_connection_t *connection);
+size_t bench_requests(bench_config_t *config, bench_connection_t *connection, long records);
+void bench_send(int epoll_fd, bench_config_t *config, bench_connection_t *connection);
+int bench_receive(int epoll_fd, bench_config_t *config, bench_connection_t *connection);
+void *bench_thread(void *arg);
+
+int main(int argc, char **argv)
+{
+    bench_config_t config;
+    parse_argv(argc, argv, &config);
+    if (sop_raise_fd_limit(config.connections + 16) < (rlim_t)config.connections + 16)
+    {
+        fprintf(stderr, "Descriptor limit is too low for %d connections\n", config.connections);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_connection_t *connections = calloc(config.connections, sizeof(bench_connection_t));
+    bench_thread_t *threads = calloc(config.thread_count, sizeof(bench_thread_t));
+    if (connections == NULL || threads == NULL)
+        ERR("calloc");
+    pthread_barrier_t connected;
+    if (pthread_barrier_init(&connected, NULL, config.thread_count + 1))
+        ERR("pthread_barrier_init");
+
+    struct timespec start, ready, end;
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    int offset = 0;
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        threads[i].config = &config;
+        threads[i].connections = connections + offset;
+        threads[i].connection_count =
+            config.connections / config.thread_count + (i < config.connections % config.thread_count);
+        threads[i].connected = &connected;
+        offset += threads[i].connection_count;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]))
+            ERR("pthread_create");
+    }
+    pthread_barrier_wait(&connected);
+    if (clock_gettime(CLOCK_MONOTONIC, &ready))
+        ERR("clock_gettime");
+    for (int i = 0; i < config.thread_count; i++)
+    {
+        if (pthread_join(threads[i].tid, NULL))
+            ERR("pthread_join");
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+
+    long total = config.count * config.connections;
+    printf("%d connections in %d threads set up in %.3f s\n", config.connections, config.thread_count,
+           ELAPSED_S(start, ready));
+    if (config.batch > 0)
+        printf("%ld requests, pipeline %d, batch %d: %.3f s, %.0f requests/s\n", total, config.depth, config.batch,
+               ELAPSED_S(ready, end), total / ELAPSED_S(ready, end));
+    else
+        printf("%ld requests, pipeline %d: %.3f s, %.0f requests/s\n", total, config.depth, ELAPSED_S(ready, end),
+               total / ELAPSED_S(ready, end));
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        if (TEMP_FAILURE_RETRY(close(connections[i].fd)) < 0)
+            ERR("close");
+        free(connections[i].in);
+        free(connections[i].out);
+    }
+    pthread_barrier_destroy(&connected);
+    free(threads);
+    free(connections);
+    return EXIT_SUCCESS;
+}
+
+void *bench_thread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    bench_config_t *config = thread->config;
+    int epoll_fd;
+    if ((epoll_fd = epoll_create1(0)) < 0)
+        ERR("epoll_create:");
+    for (int i = 0; i < thread->connection_count; i++)
+    {
+        bench_connection_t *connection = &thread->connections[i];
+        bench_buffers(config, connection);
+        connection->fd = sop_connect_sockstream(config->host, config->port);
+        if (sop_setnonblock(connection->fd) == -1)
+            ERR("sop_setnonblock");
+        struct epoll_event event;
+        event.data.ptr = connection;
+        event.events = EPOLLIN;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0)
+            ERR("epoll_ctl");
+    }
+    pthread_barrier_wait(thread->connected);
+
+    for (int i = 0; i < thread->connection_count; i++)
+        bench_send(epoll_fd, config, &thread->connections[i]);
+    int running = thread->connection_count;
+    struct epoll_event events[MAX_EVENTS];
+    while (running > 0)
+    {
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (nfds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < nfds; i++)
+        {
+            bench_connection_t *connection = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT)
+                bench_send(epoll_fd, config, connection);
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && bench_receive(epoll_fd, config, connection))
+                running--;
+        }
+    }
+    if (TEMP_FAILURE_RETRY(close(epoll_fd)) < 0)
+        ERR("close");
+    return NULL;
+}
+
+void usage(char *pname)
+{
+    fprintf(stderr,
+            "USAGE: %s [--connections N] [--threads N] [--count REQUESTS_PER_CONNECTION] [--pipeline D] [--batch K] "
+            "host port\n",
+            pname);
+    exit(EXIT_FAILURE);
+}
+
+void parse_argv(int argc, char **argv, bench_config_t *config)
+{
+    static struct option options[] = {
+        {"connections", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 't'},
+        {"count", required_argument, NULL, 'c'},
+        {"pipeline", required_argument, NULL, 'p'},
+        {"batch", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    config->connections = 100;
+    config->count = 1000;
+    config->depth = 1;
+    config->batch = 0;
+    config->thread_count = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:t:c:p:b:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                if (sscanf(optarg, "%d", &config->connections) != 1 || config->connections <= 0)
+                    usage(argv[0]);
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &config->thread_count) != 1 || config->thread_count <= 0 ||
+                    config->thread_count > MAX_THREADS)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                if (sscanf(optarg, "%ld", &config->count) != 1 || config->count <= 0)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d", &config->depth) != 1 || config->depth <= 0 || config->depth > MAX_PIPELINE)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                if (sscanf(optarg, "%d", &config->batch) != 1 || config->batch < 0 ||
+                    config->batch > BATCH_MAX_RECORDS)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    config->host = argv[optind];
+    config->port = argv[optind + 1];
+    if (config->thread_count > config->connections)
+        config->thread_count = config->connections;
+}
+
+int16_t digit_sum(long value)
+{
+    int16_t sum = 0;
+    for (; value > 0; value /= 10)
+        sum += (int16_t)(value % 10);
+    return sum;
+}
+
+// Every connection asks about different numbers.
+long request_value(bench_connection_t *connection, long index)
+{
+    return ((long)connection->fd * 7919 + index) % 10000000;
+}
+
+// With batches the pipeline depth counts frames, every one of them carrying up to batch records.
+void bench_buffers(bench_config_t *config, bench_connection_t *connection)
+{
+    size_t records = (size_t)config->depth * (config->batch > 0 ? config->batch : 1);
+    size_t out_size = config->batch > 0 ? config->depth * (BATCH_HEADER_SIZE + (size_t)config->batch * BATCH_LANE)
+                                        : records * PID_LENGTH;
+    connection->in_size = records * sizeof(int16_t);
+    if ((connection->in = malloc(connection->in_size)) == NULL || (connection->out = malloc(out_size)) == NULL)
+        ERR("malloc");
+}
+
+// Writes the next records to the output buffer, returns its length.
+size_t bench_requests(bench_config_t *config, bench_connection_t *connection, long records)
+{
+    if (config->batch == 0)
+    {
+        memset(connection->out, 0, records * PID_LENGTH);
+        for (long i = 0; i < records; i++)
+        {
+            if (snprintf(connection->out + i * PID_LENGTH, PID_LENGTH, "%ld",
+                         request_value(connection, connection->sent + i)) < 0)
+                ERR("snprintf");
+        }
+        return records * PID_LENGTH;
+    }
+
+    size_t length = 0;
+    for (long i = 0; i < records; i += config->batch)
+    {
+        uint16_t count = records - i < config->batch ? records - i : config->batch;
+        char *frame = connection->out + length;
+        frame[0] = BATCH_MAGIC;
+        frame[1] = 0;
+        uint16_t header = htons(count);
+        memcpy(frame + 2, &header, sizeof(header));
+        memset(frame + BATCH_HEADER_SIZE, 0, (size_t)count * BATCH_LANE);
+        for (int j = 0; j < count; j++)
+        {
+            if (snprintf(frame + BATCH_HEADER_SIZE + j * BATCH_LANE, BATCH_LANE, "%ld",
+                         request_value(connection, connection->sent + i + j)) < 0)
+                ERR("snprintf");
+        }
+        length += BATCH_HEADER_SIZE + (size_t)count * BATCH_LANE;
+    }
+    return length;
+}
+
+// Fills the pipeline up to its depth, unless earlier requests are still waiting for the socket.
+void bench_send(int epoll_fd, bench_config_t *config, bench_connection_t *connection)
+{
+    if (connection->out_offset == connection->out_len)
+    {
+        // Only whole frames are sent, so the window always has room for a full one.
+        long window = (long)config->depth * (config->batch > 0 ? config->batch : 1);
+        long records = window - (connection->sent - connection->received);
+        if (config->batch > 0)
+            records -= records % config->batch;
+        if (records > config->count - connection->sent)
+            records = config->count - connection->sent;
+        connection->out_len = bench_requests(config, connection, records);
+        connection->sent += records;
+        connection->out_offset = 0;
+    }
+
+    ssize_t size = sop_write_nonblock(connection->fd, connection->out + connection->out_offset,
+                                      connection->out_len - connection->out_offset);
+    if (size < 0)
+        ERR("sop_write_nonblock:");
+    connection->out_offset += size;
+    int waiting = connection->out_offset < connection->out_len;
+    if (waiting != connection->waiting)
+    {
+        struct epoll_event event;
+        event.data.ptr = connection;
+        event.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+            ERR("epoll_ctl");
+        connection->waiting = waiting;
+    }
+}
+
+// Checks the answers which have arrived and sends more requests. Returns 1 once the connection is done.
+int bench_receive(int epoll_fd, bench_config_t *config, bench_connection_t *connection)
+{
+    int eof;
+    ssize_t size = sop_read_nonblock(connection->fd, connection->in + connection->in_len,
+                                     connection->in_size - connection->in_len, &eof);
+    if (size < 0)
+        ERR("sop_read_nonblock:");
+    if (eof)
+    {
+        fprintf(stderr, "Server closed a connection after %ld responses\n", connection->received);
+        exit(EXIT_FAILURE);
+    }
+    connection->in_len += size;
+    size_t answers = connection->in_len / sizeof(int16_t);
+    for (size_t i = 0; i < answers; i++)
+    {
+        int16_t answer;
+        memcpy(&answer, connection->in + i * sizeof(int16_t), sizeof(int16_t));
+        if (ntohs(answer) != digit_sum(request_value(connection, connection->received)))
+        {
+            fprintf(stderr, "Wrong answer %d to request %ld\n", ntohs(answer), connection->received);
+            exit(EXIT_FAILURE);
+        }
+        connection->received++;
+    }
+    connection->in_len -= answers * sizeof(int16_t);
+    memmove(connection->in, connection->in + answers * sizeof(int16_t), connection->in_len);
+
+    if (connection->received == config->count)
+        return 1;
+    if (connection->sent < config->count && !connection->waiting)
+        bench_send(epoll_fd, config, connection);
+    return 0;
+}
@@ -1,38 +1,454 @@
 #include "sop-socket.h"
+#include "sop-pool.h"
+
+#include <getopt.h>
+#include <time.h>
+
+#define ELAPSED_S(start, end) ((end).tv_sec - (start).tv_sec + ((end).tv_nsec - (start).tv_nsec) / 1e9)
+// A datagram not answered by then is taken as lost.
+#define DATAGRAM_TIMEOUT_S 1
 
 void usage(char *pname);
+int16_t digit_sum(long value);
+void make_request(char *record, long value);
+int compare_doubles(const void *a, const void *b);
+void print_latencies(double *latencies, long count);
+int16_t query_connection(char *host, char *port, char *request);
+void query_once(char *host, char *port, int udp);
+void query_connect_each(char *host, char *port, long count);
+void query_pool(char *host, char *port, long count, int depth, int pool_size);
+void query_pipelined(char *host, char *port, long count, int depth);
+void query_datagrams(char *host, char *port, long count, int depth);
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    static struct option options[] = {
+        {"count", required_argument, NULL, 'c'},
+        {"pipeline", required_argument, NULL, 'p'},
+        {"udp", no_argument, NULL, 'u'},
+        {"connect-each", no_argument, NULL, 'e'},
+        {"pool", required_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0},
+    };
+    long count = 0;
+    int depth = 1;
+    int udp = 0;
+    int connect_each = 0;
+    int pool_size = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:p:ueP:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (sscanf(optarg, "%ld", &count) != 1 || count <= 0)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d", &depth) != 1 || depth <= 0)
+                    usage(argv[0]);
+                break;
+            case 'u':
+                udp = 1;
+                break;
+            case 'e':
+                connect_each = 1;
+                break;
+            case 'P':
+                if (sscanf(optarg, "%d", &pool_size) != 1 || pool_size <= 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || udp + connect_each + (pool_size > 0) > 1 || (connect_each && depth > 1))
         usage(argv[0]);
 
-    char* host = argv[1];
-    char* port = argv[2];
+    char *host = argv[optind];
+    char *port = argv[optind + 1];
+
+    if (count == 0)
+        query_once(host, port, udp);
+    else if (udp)
+        query_datagrams(host, port, count, depth);
+    else if (connect_each)
+        query_connect_each(host, port, count);
+    else if (pool_size > 0)
+        query_pool(host, port, count, depth, pool_size);
+    else
+        query_pipelined(host, port, count, depth);
+    return EXIT_SUCCESS;
+}
 
+void usage(char *pname)
+{
+    printf("USAGE: %s [--udp] [--count N [--pipeline D]] host port\n"
+           "       %s --count N --connect-each host port\n"
+           "       %s --count N --pool CONNECTIONS [--pipeline D] host port\n",
+           pname, pname, pname);
+    exit(EXIT_FAILURE);
+}
+
+int16_t digit_sum(long value)
+{
+    int16_t sum = 0;
+    for (; value > 0; value /= 10)
+        sum += (int16_t)(value % 10);
+    return sum;
+}
+
+void make_request(char *record, long value)
+{
+    memset(record, 0, PID_LENGTH);
+    if (snprintf(record, PID_LENGTH, "%ld", value) < 0)
+        ERR("snprintf");
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the latencies (in seconds) and prints their percentiles.
+void print_latencies(double *latencies, long count)
+{
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    printf("[%d]: latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", getpid(),
+           latencies[count / 2] * 1e6, latencies[count * 99 / 100] * 1e6, latencies[count * 999 / 1000] * 1e6,
+           latencies[count - 1] * 1e6);
+}
+
+void query_once(char *host, char *port, int udp)
+{
     pid_t pid = getpid();
     int16_t answer;
     char buffer[PID_LENGTH];
-    if (snprintf(buffer, PID_LENGTH, "%d", pid) < 0)
-        ERR("snprintf");
+    make_request(buffer, pid);
     printf("[%d]: PID = %d\n", getpid(), pid);
 
+    if (udp)
+    {
+        int client_socket = sop_connect_sockdgram(host, port);
+        struct timeval timeout = {DATAGRAM_TIMEOUT_S, 0};
+        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+            ERR("setsockopt");
+        if (TEMP_FAILURE_RETRY(send(client_socket, buffer, PID_LENGTH, 0)) < 0)
+            ERR("send:");
+        // A datagram comes whole or not at all.
+        if (TEMP_FAILURE_RETRY(recv(client_socket, &answer, sizeof(int16_t), 0)) < (int)sizeof(int16_t))
+            ERR("recv:");
+        printf("[%d]: SUM = %d\n", getpid(), ntohs(answer));
+        if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
+            ERR("close");
+        return;
+    }
+
+    printf("[%d]: SUM = %d\n", getpid(), query_connection(host, port, buffer));
+}
+
+// A connection of its own for a single request, the way the client always did it.
+int16_t query_connection(char *host, char *port, char *request)
+{
+    int16_t answer;
     int client_socket = sop_connect_sockstream(host, port);
 
-    if (sop_bulk_write(client_socket, buffer, PID_LENGTH) < 0)
+    if (sop_bulk_write(client_socket, request, PID_LENGTH) < 0)
         ERR("write:");
     if (sop_bulk_read(client_socket, (char *)&answer, sizeof(int16_t)) < (int)sizeof(int16_t))
         ERR("read:");
-    
-    printf("[%d]: SUM = %d\n", getpid(), ntohs(answer));
 
     if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
         ERR("close");
-    return EXIT_SUCCESS;
+    return ntohs(answer);
 }
 
-void usage(char *pname)
+// Sends count requests one by one, with a handshake and a close for each.
+void query_connect_each(char *host, char *port, long count)
 {
-    printf("USAGE: %s host port\n", pname);
-    exit(EXIT_FAILURE);
-}
\ No newline at end of file
+    double *latencies = malloc((size_t)count * sizeof(double));
+    if (latencies == NULL)
+        ERR("malloc");
+    long base = getpid();
+    char request[PID_LENGTH];
+    struct timespec start, sent_at, now;
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    for (long i = 0; i < count; i++)
+    {
+        make_request(request, (base + i) % 10000000);
+        if (clock_gettime(CLOCK_MONOTONIC, &sent_at))
+            ERR("clock_gettime");
+        int16_t answer = query_connection(host, port, request);
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        if (answer != digit_sum((base + i) % 10000000))
+        {
+            fprintf(stderr, "[%d]: Wrong answer %d to request %ld\n", getpid(), answer, i);
+            exit(EXIT_FAILURE);
+        }
+        latencies[i] = ELAPSED_S(sent_at, now);
+    }
+
+    double elapsed = ELAPSED_S(start, now);
+    printf("[%d]: %ld requests, a connection each: %.3f s, %.0f requests/s\n", getpid(), count, elapsed,
+           count / elapsed);
+    print_latencies(latencies, count);
+    free(latencies);
+}
+
+/*
+ * Sends count requests through a pool of connections: one sop_pool_query
+ * at a time, or with a depth batches of that many requests, one in flight
+ * on every connection of the pool.
+ */
+void query_pool(char *host, char *port, long count, int depth, int pool_size)
+{
+    pid_t *pids = malloc((size_t)count * sizeof(pid_t));
+    int16_t *sums = malloc((size_t)count * sizeof(int16_t));
+    double *latencies = malloc((size_t)count * sizeof(double));
+    sop_pool_batch_t *batches = malloc((size_t)pool_size * sizeof(sop_pool_batch_t));
+    if (pids == NULL || sums == NULL || latencies == NULL || batches == NULL)
+        ERR("malloc");
+    long base = getpid();
+    for (long i = 0; i < count; i++)
+        pids[i] = (base + i) % 10000000;
+
+    sop_pool_t pool;
+    sop_pool_init(&pool, host, port, pool_size);
+    struct timespec start, sent_at, now;
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    for (long next = 0; next < count;)
+    {
+        if (clock_gettime(CLOCK_MONOTONIC, &sent_at))
+            ERR("clock_gettime");
+        long first = next;
+        if (depth == 1)
+            sums[next++] = sop_pool_query(&pool, pids[first]);
+        else
+        {
+            int in_flight = 0;
+            for (; in_flight < pool_size && next < count; in_flight++)
+            {
+                long records = count - next < depth ? count - next : depth;
+                sop_pool_submit(&pool, &batches[in_flight], pids + next, records, sums + next);
+                next += records;
+            }
+            for (int i = 0; i < in_flight; i++)
+                sop_pool_wait(&pool, &batches[i]);
+        }
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        // A request of a batch is done when its whole round is.
+        for (long i = first; i < next; i++)
+            latencies[i] = ELAPSED_S(sent_at, now);
+    }
+    for (long i = 0; i < count; i++)
+    {
+        if (sums[i] != digit_sum(pids[i]))
+        {
+            fprintf(stderr, "[%d]: Wrong answer %d to request %ld\n", getpid(), sums[i], i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double elapsed = ELAPSED_S(start, now);
+    printf("[%d]: %ld requests, pool of %d, pipeline %d: %.3f s, %.0f requests/s\n", getpid(), count, pool_size,
+           depth, elapsed, count / elapsed);
+    print_latencies(latencies, count);
+    sop_pool_destroy(&pool);
+    free(pids);
+    free(sums);
+    free(latencies);
+    free(batches);
+}
+
+/*
+ * Sends count requests over one connection, keeping up to depth of them
+ * unanswered: the window is refilled with one write as responses come back.
+ * Every request is a different number, every answer is checked.
+ */
+void query_pipelined(char *host, char *port, long count, int depth)
+{
+    char *requests = malloc((size_t)depth * PID_LENGTH);
+    char *responses = malloc((size_t)depth * sizeof(int16_t));
+    // Send times of the requests in the window, indexed by request number modulo depth.
+    struct timespec *sent_at = malloc((size_t)depth * sizeof(struct timespec));
+    double *latencies = malloc((size_t)count * sizeof(double));
+    if (requests == NULL || responses == NULL || sent_at == NULL || latencies == NULL)
+        ERR("malloc");
+    long base = getpid();
+    long sent = 0, received = 0;
+    size_t responses_len = 0;
+
+    struct timespec start, now, end;
+    int client_socket = sop_connect_sockstream(host, port);
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    while (received < count)
+    {
+        long batch = depth - (sent - received);
+        if (batch > count - sent)
+            batch = count - sent;
+        for (long i = 0; i < batch; i++)
+            make_request(requests + i * PID_LENGTH, (base + sent + i) % 10000000);
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        for (long i = 0; i < batch; i++)
+            sent_at[(sent + i) % depth] = now;
+        if (batch > 0 && sop_bulk_write(client_socket, requests, batch * PID_LENGTH) < 0)
+            ERR("write:");
+        sent += batch;
+
+        ssize_t size = TEMP_FAILURE_RETRY(read(client_socket, responses + responses_len,
+                                               (sent - received) * sizeof(int16_t) - responses_len));
+        if (size < 0)
+            ERR("read:");
+        if (size == 0)
+        {
+            fprintf(stderr, "[%d]: Server closed the connection after %ld responses\n", getpid(), received);
+            exit(EXIT_FAILURE);
+        }
+        responses_len += size;
+        size_t answers = responses_len / sizeof(int16_t);
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        for (size_t i = 0; i < answers; i++)
+        {
+            int16_t answer;
+            memcpy(&answer, responses + i * sizeof(int16_t), sizeof(int16_t));
+            if (ntohs(answer) != digit_sum((base + received) % 10000000))
+            {
+                fprintf(stderr, "[%d]: Wrong answer %d to request %ld\n", getpid(), ntohs(answer), received);
+                exit(EXIT_FAILURE);
+            }
+            latencies[received] = ELAPSED_S(sent_at[received % depth], now);
+            received++;
+        }
+        responses_len -= answers * sizeof(int16_t);
+        memmove(responses, responses + answers * sizeof(int16_t), responses_len);
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+
+    double elapsed = ELAPSED_S(start, end);
+    printf("[%d]: %ld requests, pipeline %d: %.3f s, %.0f requests/s\n", getpid(), count, depth, elapsed,
+           count / elapsed);
+    print_latencies(latencies, count);
+    if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
+        ERR("close");
+    free(requests);
+    free(responses);
+    free(sent_at);
+    free(latencies);
+}
+
+/*
+ * The same over UDP: a datagram per request, the window refilled with one
+ * sendmmsg and the answers collected with recvmmsg, as many as have come.
+ * Loopback keeps them in order, a lost one ends the run after a timeout.
+ */
+void query_datagrams(char *host, char *port, long count, int depth)
+{
+    char *requests = malloc((size_t)depth * PID_LENGTH);
+    int16_t *responses = malloc((size_t)depth * sizeof(int16_t));
+    struct mmsghdr *messages = calloc(depth, sizeof(struct mmsghdr));
+    struct iovec *iov = calloc(depth, sizeof(struct iovec));
+    struct timespec *sent_at = malloc((size_t)depth * sizeof(struct timespec));
+    double *latencies = malloc((size_t)count * sizeof(double));
+    if (requests == NULL || responses == NULL || messages == NULL || iov == NULL || sent_at == NULL ||
+        latencies == NULL)
+        ERR("malloc");
+    for (int i = 0; i < depth; i++)
+    {
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    long base = getpid();
+    long sent = 0, received = 0;
+
+    struct timespec start, now, end;
+    int client_socket = sop_connect_sockdgram(host, port);
+    struct timeval timeout = {DATAGRAM_TIMEOUT_S, 0};
+    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+        ERR("setsockopt");
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    while (received < count)
+    {
+        long batch = depth - (sent - received);
+        if (batch > count - sent)
+            batch = count - sent;
+        for (long i = 0; i < batch; i++)
+        {
+            make_request(requests + i * PID_LENGTH, (base + sent + i) % 10000000);
+            iov[i].iov_base = requests + i * PID_LENGTH;
+            iov[i].iov_len = PID_LENGTH;
+        }
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        for (long i = 0; i < batch; i++)
+            sent_at[(sent + i) % depth] = now;
+        for (long i = 0; i < batch;)
+        {
+            int size = sendmmsg(client_socket, messages + i, batch - i, 0);
+            if (size < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ERR("sendmmsg");
+            }
+            i += size;
+        }
+        sent += batch;
+
+        long waiting = sent - received;
+        for (long i = 0; i < waiting; i++)
+        {
+            iov[i].iov_base = &responses[i];
+            iov[i].iov_len = sizeof(int16_t);
+        }
+        int size = recvmmsg(client_socket, messages, waiting, MSG_WAITFORONE, NULL);
+        if (size < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                fprintf(stderr, "[%d]: %ld datagrams lost after %ld responses\n", getpid(), waiting, received);
+                exit(EXIT_FAILURE);
+            }
+            ERR("recvmmsg");
+        }
+        if (clock_gettime(CLOCK_MONOTONIC, &now))
+            ERR("clock_gettime");
+        for (int i = 0; i < size; i++)
+        {
+            if (messages[i].msg_len != sizeof(int16_t) || ntohs(responses[i]) != digit_sum((base + received) % 10000000))
+            {
+                fprintf(stderr, "[%d]: Wrong answer %d to request %ld\n", getpid(), ntohs(responses[i]), received);
+                exit(EXIT_FAILURE);
+            }
+            latencies[received] = ELAPSED_S(sent_at[received % depth], now);
+            received++;
+        }
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+
+    double elapsed = ELAPSED_S(start, end);
+    printf("[%d]: %ld datagrams, pipeline %d: %.3f s, %.0f requests/s\n", getpid(), count, depth, elapsed,
+           count / elapsed);
+    print_latencies(latencies, count);
+    if (TEMP_FAILURE_RETRY(close(client_socket)) < 0)
+        ERR("close");
+    free(requests);
+    free(responses);
+    free(messages);
+    free(iov);
+    free(sent_at);
+    free(latencies);
+}
@@ -0,0 +1,133 @@
+#include "sop-socket.h"
+#include "sop-digits.h"
+
+#include <time.h>
+
+#define DEFAULT_RECORDS 1000000
+#define ROUNDS 20
+
+#define ELAPSED_S(start, end) ((end).tv_sec - (start).tv_sec + ((end).tv_nsec - (start).tv_nsec) / 1e9)
+
+typedef struct kernel_t
+{
+    const char *name;
+    sop_digit_sums_t sums;
+} kernel_t;
+
+void usage(char *pname);
+void string_sums(const char *lanes, size_t count, int16_t *sums);
+void check_validation(const char *lanes, size_t count);
+double time_kernel(sop_digit_sums_t kernel, const char *lanes, size_t count, int16_t *sums);
+
+int main(int argc, char **argv)
+{
+    long count = DEFAULT_RECORDS;
+    if (argc > 2 || (argc == 2 && (sscanf(argv[1], "%ld", &count) != 1 || count <= 0)))
+        usage(argv[0]);
+
+    char *lanes = calloc(count, BATCH_LANE);
+    int16_t *expected = malloc(count * sizeof(int16_t));
+    int16_t *sums = malloc(count * sizeof(int16_t));
+    if (lanes == NULL || expected == NULL || sums == NULL)
+        ERR("malloc");
+    srand(time(NULL));
+    for (long i = 0; i < count; i++)
+    {
+        if (snprintf(lanes + i * BATCH_LANE, BATCH_LANE, "%d", rand() % 10000000) < 0)
+            ERR("snprintf");
+    }
+
+    kernel_t kernels[] = {
+        {"string", string_sums},
+        {"scalar", sop_digit_sums_scalar},
+#if defined(__x86_64__)
+        {"sse2", sop_digit_sums_sse2},
+        {"avx2", __builtin_cpu_supports("avx2") ? sop_digit_sums_avx2 : NULL},
+#endif
+    };
+    check_validation(lanes, count);
+    string_sums(lanes, count, expected);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        if (kernels[k].sums == NULL)
+        {
+            printf("%-8s not supported\n", kernels[k].name);
+            continue;
+        }
+        double elapsed = time_kernel(kernels[k].sums, lanes, count, sums);
+        if (memcmp(sums, expected, count * sizeof(int16_t)))
+        {
+            fprintf(stderr, "%s gives different sums\n", kernels[k].name);
+            exit(EXIT_FAILURE);
+        }
+        printf("%-8s %.2f ns/record\n", kernels[k].name, elapsed / ROUNDS / count * 1e9);
+    }
+
+    free(lanes);
+    free(expected);
+    free(sums);
+    return EXIT_SUCCESS;
+}
+
+// Lanes with junk after the NUL or between the digits differ between the kernels, the server must refuse them.
+void check_validation(const char *lanes, size_t count)
+{
+    const char junk[][BATCH_LANE] = {"123\0x", "12a", "-5", "9\0\0\0\0\0\0\0\0\0\0\0\0\0\xff"};
+    for (size_t i = 0; i < sizeof(junk) / sizeof(junk[0]); i++)
+    {
+        if (sop_digit_lanes_valid(junk[i], 1))
+        {
+            fprintf(stderr, "junk lane %zu passes validation\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec start, end;
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    if (!sop_digit_lanes_valid(lanes, count))
+    {
+        fprintf(stderr, "valid lanes fail validation\n");
+        exit(EXIT_FAILURE);
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+    printf("%-8s %.2f ns/record\n", "validate", ELAPSED_S(start, end) / count * 1e9);
+}
+
+void usage(char *pname)
+{
+    fprintf(stderr, "USAGE: %s [records]\n", pname);
+    exit(EXIT_FAILURE);
+}
+
+// The way the server adds up a single record, up to its NUL.
+void string_sums(const char *lanes, size_t count, int16_t *sums)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *lane = lanes + i * BATCH_LANE;
+        int16_t sum = 0;
+        for (const char *c = lane; c < lane + BATCH_LANE && *c; c++)
+            sum += (int16_t)(*c - '0');
+        sums[i] = sum;
+    }
+}
+
+double time_kernel(sop_digit_sums_t kernel, const char *lanes, size_t count, int16_t *sums)
+{
+    struct timespec start, end;
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    // Batch-sized calls, the way the server makes them.
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < count; i += BATCH_MAX_RECORDS)
+        {
+            size_t batch = count - i < BATCH_MAX_RECORDS ? count - i : BATCH_MAX_RECORDS;
+            kernel(lanes + i * BATCH_LANE, batch, sums + i);
+        }
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+    return ELAPSED_S(start, end);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+// First, it defines _GNU_SOURCE.
+#include "sop-socket.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Digit sums of batch lanes, which sop_digit_lanes_valid has accepted.
+typedef void (*sop_digit_sums_t)(const char *lanes, size_t count, int16_t *sums);
+
+static inline int sop_digit_lanes_valid(const char *lanes, size_t count)
+{
+#if defined(__x86_64__)
+    // The digit bytes have to be a prefix of the lane and everything else NUL.
+    const __m128i digit_zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    for (size_t i = 0; i < count; i++)
+    {
+        __m128i lane = _mm_loadu_si128((const __m128i *)(lanes + i * BATCH_LANE));
+        __m128i value = _mm_sub_epi8(lane, digit_zero);
+        unsigned digits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(value, nine), value));
+        unsigned nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(lane, _mm_setzero_si128()));
+        if ((digits | nuls) != 0xffff || (digits & (digits + 1)) != 0)
+            return 0;
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *lane = lanes + i * BATCH_LANE;
+        int j = 0;
+        while (j < BATCH_LANE && lane[j] >= '0' && lane[j] <= '9')
+            j++;
+        while (j < BATCH_LANE && lane[j] == '\0')
+            j++;
+        if (j < BATCH_LANE)
+            return 0;
+    }
+#endif
+    return 1;
+}
+
+static inline void sop_digit_sums_scalar(const char *lanes, size_t count, int16_t *sums)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const unsigned char *lane = (const unsigned char *)lanes + i * BATCH_LANE;
+        int16_t sum = 0;
+        for (int j = 0; j < BATCH_LANE; j++)
+            sum += lane[j] > '0' ? lane[j] - '0' : 0;
+        sums[i] = sum;
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * A lane is one 16-byte register: a saturating subtraction of '0' turns it
+ * into digits, psadbw adds each half of it up. Four lanes per iteration.
+ */
+static inline void sop_digit_sums_sse2(const char *lanes, size_t count, int16_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i digit_zero = _mm_set1_epi8('0');
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i s[4];
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i lane = _mm_loadu_si128((const __m128i *)(lanes + (i + j) * BATCH_LANE));
+            s[j] = _mm_sad_epu8(_mm_subs_epu8(lane, digit_zero), zero);
+        }
+        // The two halves of each lane, side by side: {a, b} and {c, d}.
+        __m128i ab = _mm_add_epi64(_mm_unpacklo_epi64(s[0], s[1]), _mm_unpackhi_epi64(s[0], s[1]));
+        __m128i cd = _mm_add_epi64(_mm_unpacklo_epi64(s[2], s[3]), _mm_unpackhi_epi64(s[2], s[3]));
+        // A sum fits in 16 bits: {a, 0, b, 0, c, 0, d, 0}, then {a, b, c, d}.
+        __m128i packed = _mm_packs_epi32(ab, cd);
+        packed = _mm_packs_epi32(packed, zero);
+        _mm_storel_epi64((__m128i *)(sums + i), packed);
+    }
+    sop_digit_sums_scalar(lanes + i * BATCH_LANE, count - i, sums + i);
+}
+
+// Two lanes per register, eight lanes per iteration.
+__attribute__((target("avx2"))) static inline void sop_digit_sums_avx2(const char *lanes, size_t count, int16_t *sums)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i digit_zero = _mm256_set1_epi8('0');
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i s[4];
+        for (int j = 0; j < 4; j++)
+        {
+            __m256i pair = _mm256_loadu_si256((const __m256i *)(lanes + (i + 2 * j) * BATCH_LANE));
+            s[j] = _mm256_sad_epu8(_mm256_subs_epu8(pair, digit_zero), zero);
+        }
+        // Per 128-bit half: {a, c | b, d} and {e, g | f, h}.
+        __m256i x = _mm256_add_epi64(_mm256_unpacklo_epi64(s[0], s[1]), _mm256_unpackhi_epi64(s[0], s[1]));
+        __m256i y = _mm256_add_epi64(_mm256_unpacklo_epi64(s[2], s[3]), _mm256_unpackhi_epi64(s[2], s[3]));
+        // {a, 0, c, 0, e, 0, g, 0 | b, 0, d, 0, f, 0, h, 0}, then {a, c, e, g | b, d, f, h}.
+        __m256i packed = _mm256_packs_epi32(x, y);
+        packed = _mm256_packs_epi32(packed, zero);
+        __m128i low = _mm256_castsi256_si128(packed);
+        __m128i high = _mm256_extracti128_si256(packed, 1);
+        _mm_storeu_si128((__m128i *)(sums + i), _mm_unpacklo_epi16(low, high));
+    }
+    sop_digit_sums_sse2(lanes + i * BATCH_LANE, count - i, sums + i);
+}
+#endif
+
+// The fastest kernel this processor runs.
+static inline sop_digit_sums_t sop_digit_sums_best(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return sop_digit_sums_avx2;
+    return sop_digit_sums_sse2;
+#else
+    return sop_digit_sums_scalar;
+#endif
+}
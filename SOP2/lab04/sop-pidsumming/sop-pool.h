@@ -0,0 +1,262 @@
+#pragma once
+
+#include <pthread.h>
+
+/*
+ * Persistent connections to the pidsumming server shared by threads, one the
+ * server has closed is replaced. Include it after sop-socket.h.
+ */
+
+// Requests in flight on one connection. The server reads no more while its
+// answers wait, so an unbounded batch could fill the buffers both ways.
+#define SOP_POOL_WINDOW 256
+
+typedef struct sop_pool_t
+{
+    char *host;
+    char *port;
+    int size;
+    // Idle connections, -1 for ones not opened yet.
+    int *idle;
+    int idle_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+} sop_pool_t;
+
+// A batch of queries sent over one connection, answered by sop_pool_wait.
+typedef struct sop_pool_batch_t
+{
+    int fd;
+    const pid_t *pids;
+    int16_t *sums;
+    size_t count;
+    size_t sent;
+    size_t received;
+    // An answer may arrive split, its first byte waits here.
+    char partial[sizeof(int16_t)];
+    size_t partial_len;
+    int reconnected;
+} sop_pool_batch_t;
+
+static inline void sop_pool_init(sop_pool_t *pool, char *host, char *port, int size)
+{
+    pool->host = host;
+    pool->port = port;
+    pool->size = size;
+    if ((pool->idle = malloc(size * sizeof(int))) == NULL)
+        ERR("malloc");
+    for (int i = 0; i < size; i++)
+        pool->idle[i] = -1;
+    pool->idle_count = size;
+    if (pthread_mutex_init(&pool->mutex, NULL))
+        ERR("pthread_mutex_init");
+    if (pthread_cond_init(&pool->released, NULL))
+        ERR("pthread_cond_init");
+}
+
+// Every connection must be back in the pool.
+static inline void sop_pool_destroy(sop_pool_t *pool)
+{
+    for (int i = 0; i < pool->idle_count; i++)
+    {
+        if (pool->idle[i] != -1 && TEMP_FAILURE_RETRY(close(pool->idle[i])) < 0)
+            ERR("close");
+    }
+    free(pool->idle);
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/*
+ * Takes a connection, waiting for one if all are in use. An idle
+ * connection has nothing to read, unless the server has closed it.
+ */
+static inline int sop_pool_acquire(sop_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->idle_count == 0)
+        pthread_cond_wait(&pool->released, &pool->mutex);
+    int fd = pool->idle[--pool->idle_count];
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (fd != -1)
+    {
+        struct pollfd closed = {fd, POLLIN | POLLRDHUP, 0};
+        if (TEMP_FAILURE_RETRY(poll(&closed, 1, 0)) < 0)
+            ERR("poll");
+        if (closed.revents & (POLLHUP | POLLERR | POLLRDHUP))
+        {
+            if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+                ERR("close");
+            fd = -1;
+        }
+        else if (closed.revents & POLLIN)
+        {
+            fprintf(stderr, "Unexpected data from the server on an idle connection\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (fd == -1)
+    {
+        fd = sop_connect_sockstream(pool->host, pool->port);
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    return fd;
+}
+
+static inline void sop_pool_release(sop_pool_t *pool, int fd)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->idle[pool->idle_count++] = fd;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Like sop_bulk_write, but a closed connection returns -1 rather than raising SIGPIPE.
+static inline int sop_pool_send(int fd, char *buf, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t size = TEMP_FAILURE_RETRY(send(fd, buf, count, MSG_NOSIGNAL));
+        if (size < 0 && (errno == EPIPE || errno == ECONNRESET))
+            return -1;
+        if (size < 0)
+            ERR("send");
+        buf += size;
+        count -= size;
+    }
+    return 0;
+}
+
+// Closes a connection the server has closed, its slot opens a new one when taken.
+static inline void sop_pool_discard(sop_pool_t *pool, int fd)
+{
+    if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+        ERR("close");
+    sop_pool_release(pool, -1);
+}
+
+static inline void sop_pool_make_request(char *record, pid_t pid)
+{
+    memset(record, 0, PID_LENGTH);
+    if (snprintf(record, PID_LENGTH, "%d", pid) < 0)
+        ERR("snprintf");
+}
+
+/*
+ * A query is sent again once on a new connection if the server closes the
+ * one it was sent on before answering, asking twice gives the same sum.
+ */
+static inline int16_t sop_pool_query(sop_pool_t *pool, pid_t pid)
+{
+    char request[PID_LENGTH];
+    int16_t answer;
+    sop_pool_make_request(request, pid);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int fd = sop_pool_acquire(pool);
+        if (sop_pool_send(fd, request, PID_LENGTH) == 0)
+        {
+            ssize_t size = sop_bulk_read(fd, (char *)&answer, sizeof(int16_t));
+            if (size < 0 && errno != ECONNRESET)
+                ERR("read");
+            if (size == sizeof(int16_t))
+            {
+                sop_pool_release(pool, fd);
+                return ntohs(answer);
+            }
+        }
+        sop_pool_discard(pool, fd);
+    }
+    fprintf(stderr, "Server closed the connection before answering\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Moves the batch to a new connection once the server has closed its own,
+ * the queries not answered yet are sent again, like in sop_pool_query.
+ */
+static inline void sop_pool_reconnect(sop_pool_t *pool, sop_pool_batch_t *batch)
+{
+    if (batch->reconnected)
+    {
+        fprintf(stderr, "Server closed the connection after %zu of %zu answers\n", batch->received, batch->count);
+        exit(EXIT_FAILURE);
+    }
+    batch->reconnected = 1;
+    sop_pool_discard(pool, batch->fd);
+    batch->fd = sop_pool_acquire(pool);
+    batch->sent = batch->received;
+    batch->partial_len = 0;
+}
+
+// Sends as many requests as the window has room for, in one write.
+static inline void sop_pool_fill(sop_pool_t *pool, sop_pool_batch_t *batch)
+{
+    char requests[SOP_POOL_WINDOW * PID_LENGTH];
+    for (;;)
+    {
+        size_t records = SOP_POOL_WINDOW - (batch->sent - batch->received);
+        if (records > batch->count - batch->sent)
+            records = batch->count - batch->sent;
+        if (records == 0)
+            return;
+        for (size_t i = 0; i < records; i++)
+            sop_pool_make_request(requests + i * PID_LENGTH, batch->pids[batch->sent + i]);
+        if (sop_pool_send(batch->fd, requests, records * PID_LENGTH) == 0)
+        {
+            batch->sent += records;
+            return;
+        }
+        sop_pool_reconnect(pool, batch);
+    }
+}
+
+/*
+ * Starts count queries on a connection of its own and returns once the
+ * first window of them is sent. The sums are there after sop_pool_wait,
+ * pids and sums must stay valid until then.
+ */
+static inline void sop_pool_submit(sop_pool_t *pool, sop_pool_batch_t *batch, const pid_t *pids, size_t count,
+                                   int16_t *sums)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->pids = pids;
+    batch->sums = sums;
+    batch->count = count;
+    batch->fd = sop_pool_acquire(pool);
+    sop_pool_fill(pool, batch);
+}
+
+// Sends the rest of the batch as answers free the window, and collects them all.
+static inline void sop_pool_wait(sop_pool_t *pool, sop_pool_batch_t *batch)
+{
+    char answers[SOP_POOL_WINDOW * sizeof(int16_t)];
+    while (batch->received < batch->count)
+    {
+        memcpy(answers, batch->partial, batch->partial_len);
+        ssize_t size = TEMP_FAILURE_RETRY(read(batch->fd, answers + batch->partial_len,
+                                               (batch->sent - batch->received) * sizeof(int16_t) - batch->partial_len));
+        if (size < 0 && errno != ECONNRESET)
+            ERR("read");
+        if (size <= 0)
+        {
+            sop_pool_reconnect(pool, batch);
+            sop_pool_fill(pool, batch);
+            continue;
+        }
+        size += batch->partial_len;
+        size_t whole = size / sizeof(int16_t);
+        for (size_t i = 0; i < whole; i++)
+        {
+            int16_t answer;
+            memcpy(&answer, answers + i * sizeof(int16_t), sizeof(int16_t));
+            batch->sums[batch->received++] = ntohs(answer);
+        }
+        batch->partial_len = size - whole * sizeof(int16_t);
+        memcpy(batch->partial, answers + whole * sizeof(int16_t), batch->partial_len);
+        sop_pool_fill(pool, batch);
+    }
+    sop_pool_release(pool, batch->fd);
+    batch->fd = -1;
+}
@@ -1,37 +1,143 @@
 #include "sop-socket.h"
+#include "sop-digits.h"
 
-#define BACKLOG 3
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+// Thousands of clients may connect at once, a short queue would have them retry after a second.
+#define BACKLOG SOMAXCONN
+#define MAX_CONNECTIONS 10000
 #define MAX_EVENTS 16
+#define MAX_WORKERS 64
+// Room for a whole batch, or for that many bytes of single records sent back-to-back.
+#define IN_BUFFER_SIZE BATCH_FRAME_MAX
+// Single records get the most responses out of a buffer.
+#define OUT_BUFFER_SIZE (IN_BUFFER_SIZE / PID_LENGTH * sizeof(int16_t))
+// Datagrams received and answered with one system call each.
+#define MAX_DATAGRAMS 64
+
+typedef enum balance_t
+{
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_LOADED,
+} balance_t;
+
+typedef struct connection_t
+{
+    int fd;
+    char in[IN_BUFFER_SIZE];
+    size_t in_len;
+    char out[OUT_BUFFER_SIZE];
+    size_t out_len;
+    size_t out_offset;
+    // Set while the responses wait for EPOLLOUT.
+    int waiting;
+    struct connection_t *prev;
+    struct connection_t *next;
+} connection_t;
+
+/*
+ * An event loop and the connections it serves. With --workers the acceptor
+ * queues new connections in pending and signals event_fd, the worker moves
+ * them to its own epoll. Everything the acceptor touches is under mutex.
+ */
+typedef struct worker_t
+{
+    pthread_t tid;
+    int epoll_fd;
+    int event_fd;
+    // Only used by the loop's own thread.
+    connection_t *connections;
+    pthread_mutex_t mutex;
+    connection_t *pending;
+    int connection_count;
+    int stopping;
+} worker_t;
+
+/*
+ * Room for MAX_DATAGRAMS requests from recvmmsg and their responses for
+ * sendmmsg, every response goes back to the address its request came from.
+ */
+typedef struct datagrams_t
+{
+    struct mmsghdr requests[MAX_DATAGRAMS];
+    struct iovec request_iov[MAX_DATAGRAMS];
+    struct sockaddr_in addresses[MAX_DATAGRAMS];
+    char in[MAX_DATAGRAMS][BATCH_FRAME_MAX];
+    struct mmsghdr responses[MAX_DATAGRAMS];
+    struct iovec response_iov[MAX_DATAGRAMS];
+    char out[MAX_DATAGRAMS][BATCH_MAX_RECORDS * sizeof(int16_t)];
+} datagrams_t;
+
+typedef struct server_config_t
+{
+    uint16_t port;
+    int udp;
+    sop_tcp_profile_t profile;
+    int worker_count;
+    balance_t balance;
+} server_config_t;
 
 volatile sig_atomic_t do_work = 1;
+sop_digit_sums_t digit_sums;
+// Set by --verbose, reports every connection, read and datagram.
+int verbose = 0;
 
 void sigint_handler(int sig);
 void usage(char *pname);
+void parse_argv(int argc, char **argv, server_config_t *config);
 int16_t evaluate_response(char *pid);
+int evaluate_batch(char *lanes, int count, char *responses);
+int evaluate_requests(connection_t *connection);
+ssize_t evaluate_datagram(char *request, size_t length, char *responses);
+void add_connection(worker_t *worker, connection_t *connection);
+void serve_connection(worker_t *worker, connection_t *connection);
+void close_connection(worker_t *worker, connection_t *connection);
+void worker_init(worker_t *worker);
+void worker_destroy(worker_t *worker);
 void work(int server_socket, sigset_t oldmask);
+void *worker_thread(void *arg);
+void worker_adopt(worker_t *worker);
+worker_t *choose_worker(worker_t *workers, server_config_t *config, int *next);
+void accept_loop(int server_socket, server_config_t *config, sigset_t oldmask);
+void serve_datagrams(int server_socket, sigset_t oldmask);
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
-        usage(argv[0]);
+    server_config_t config;
+    parse_argv(argc, argv, &config);
+    digit_sums = sop_digit_sums_best();
 
-    uint16_t port = (uint16_t)atoi(argv[1]);
+    // Every connection holds a descriptor, and the epoll loop has no FD_SETSIZE limit.
+    if (sop_raise_fd_limit(MAX_CONNECTIONS + 16) < MAX_CONNECTIONS + 16)
+        fprintf(stderr, "[%d]: Descriptor limit is too low for %d connections\n", getpid(), MAX_CONNECTIONS);
 
     if (sop_sethandler(SIG_IGN, SIGPIPE))
         ERR("Seting SIGPIPE:");
     if (sop_sethandler(sigint_handler, SIGINT))
         ERR("Seting SIGINT:");
 
+    // Workers inherit the blocked SIGINT, only the thread in epoll_pwait gets it.
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-    int server_socket = sop_bind_sockstream(port, BACKLOG);
+    int server_socket;
+    if (config.udp)
+        server_socket = sop_bind_sockdgram(config.port);
+    else
+        server_socket = sop_bind_sockstream(config.port, BACKLOG, &config.profile);
     if (sop_setnonblock(server_socket) == -1)
         ERR("sop_setnonblock");
 
-    work(server_socket, oldmask);
+    if (config.udp)
+        serve_datagrams(server_socket, oldmask);
+    else if (config.worker_count == 0)
+        work(server_socket, oldmask);
+    else
+        accept_loop(server_socket, &config, oldmask);
     sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
     if (TEMP_FAILURE_RETRY(close(server_socket)) < 0)
@@ -48,76 +154,339 @@ void sigint_handler(int sig)
 
 void usage(char *pname)
 {
-    printf("USAGE: %s port\n", pname);
+    printf("USAGE: %s [--workers N [--balance round-robin|least-loaded]] [--tcp-profile none|latency|throughput]\n"
+           "          [--defer-accept S] [--busy-poll USEC] [--verbose] port\n"
+           "       %s --udp [--verbose] port\n",
+           pname, pname);
     exit(EXIT_FAILURE);
 }
 
+void parse_argv(int argc, char **argv, server_config_t *config)
+{
+    static struct option options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"balance", required_argument, NULL, 'b'},
+        {"tcp-profile", required_argument, NULL, 't'},
+        {"defer-accept", required_argument, NULL, 'd'},
+        {"busy-poll", required_argument, NULL, 'y'},
+        {"udp", no_argument, NULL, 'u'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0},
+    };
+    config->udp = 0;
+    config->worker_count = 0;
+    config->balance = BALANCE_ROUND_ROBIN;
+    sop_tcp_profile_parse("latency", &config->profile);
+    // Given apart from the profile, which --tcp-profile replaces as a whole.
+    int defer_accept = -1;
+    int busy_poll = -1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:b:t:d:y:uv", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                if (sscanf(optarg, "%d", &config->worker_count) != 1 || config->worker_count < 0 ||
+                    config->worker_count > MAX_WORKERS)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                if (strcmp(optarg, "round-robin") == 0)
+                    config->balance = BALANCE_ROUND_ROBIN;
+                else if (strcmp(optarg, "least-loaded") == 0)
+                    config->balance = BALANCE_LEAST_LOADED;
+                else
+                    usage(argv[0]);
+                break;
+            case 't':
+                if (sop_tcp_profile_parse(optarg, &config->profile) < 0)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                if (sscanf(optarg, "%d", &defer_accept) != 1 || defer_accept < 0)
+                    usage(argv[0]);
+                break;
+            case 'y':
+                if (sscanf(optarg, "%d", &busy_poll) != 1 || busy_poll < 0)
+                    usage(argv[0]);
+                break;
+            case 'u':
+                config->udp = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (defer_accept >= 0)
+        config->profile.defer_accept = defer_accept;
+    if (busy_poll >= 0)
+        config->profile.busy_poll = busy_poll;
+    // Datagrams are served by a single loop, there are no connections to hand out.
+    if (argc - optind != 1 || (config->udp && config->worker_count > 0))
+        usage(argv[0]);
+    config->port = (uint16_t)atoi(argv[optind]);
+}
+
 int16_t evaluate_response(char *pid)
 {
     int16_t response = 0;
-    for (char *c = pid; *c; c++)
+    // Records follow each other in the buffer, one without a NUL must not run into the next.
+    for (char *c = pid; c < pid + PID_LENGTH && *c; c++)
     {
         response += (int16_t)(*c - '0');
     }
     return response;
 }
 
-void work(int server_socket, sigset_t oldmask)
+// Writes the sums of count lanes to responses, in network order. Returns -1 for a malformed lane.
+int evaluate_batch(char *lanes, int count, char *responses)
 {
-    int epoll_fd;
-    if ((epoll_fd = epoll_create1(0)) < 0)
+    int16_t sums[BATCH_MAX_RECORDS];
+    if (!sop_digit_lanes_valid(lanes, count))
+        return -1;
+    digit_sums(lanes, count, sums);
+    for (int i = 0; i < count; i++)
+    {
+        int16_t response = htons(sums[i]);
+        memcpy(responses + i * sizeof(int16_t), &response, sizeof(int16_t));
+    }
+    return 0;
+}
+
+/*
+ * Answers every whole request in the input buffer, single records and
+ * batches alike, in the order they came. An unfinished one waits for the
+ * rest of it. Returns -1 for a malformed batch.
+ */
+int evaluate_requests(connection_t *connection)
+{
+    size_t offset = 0;
+    int records = 0;
+    while (offset < connection->in_len)
+    {
+        char *request = connection->in + offset;
+        size_t available = connection->in_len - offset;
+        if (request[0] != BATCH_MAGIC)
+        {
+            if (available < PID_LENGTH)
+                break;
+            int16_t response = htons(evaluate_response(request));
+            memcpy(connection->out + connection->out_len, &response, sizeof(int16_t));
+            connection->out_len += sizeof(int16_t);
+            offset += PID_LENGTH;
+            records++;
+            continue;
+        }
+
+        if (available < BATCH_HEADER_SIZE)
+            break;
+        uint16_t count;
+        memcpy(&count, request + 2, sizeof(count));
+        count = ntohs(count);
+        if (count == 0 || count > BATCH_MAX_RECORDS)
+            return -1;
+        if (available < BATCH_HEADER_SIZE + (size_t)count * BATCH_LANE)
+            break;
+        if (evaluate_batch(request + BATCH_HEADER_SIZE, count, connection->out + connection->out_len) < 0)
+            return -1;
+        connection->out_len += count * sizeof(int16_t);
+        offset += BATCH_HEADER_SIZE + (size_t)count * BATCH_LANE;
+        records += count;
+    }
+    connection->in_len -= offset;
+    memmove(connection->in, connection->in + offset, connection->in_len);
+    if (verbose && records > 0)
+        fprintf(stderr, "[%d]: Server evaluating %d responses for %d\n", getpid(), records, connection->fd);
+    return 0;
+}
+
+/*
+ * A datagram is one batch frame or one record, whose NUL may be left out.
+ * Returns the length of the response, -1 for a malformed request.
+ */
+ssize_t evaluate_datagram(char *request, size_t length, char *responses)
+{
+    if (length == 0)
+        return -1;
+    if (request[0] != BATCH_MAGIC)
+    {
+        if (length > PID_LENGTH)
+            return -1;
+        char pid[PID_LENGTH] = {0};
+        memcpy(pid, request, length);
+        int16_t response = htons(evaluate_response(pid));
+        memcpy(responses, &response, sizeof(int16_t));
+        return sizeof(int16_t);
+    }
+
+    if (length < BATCH_HEADER_SIZE)
+        return -1;
+    uint16_t count;
+    memcpy(&count, request + 2, sizeof(count));
+    count = ntohs(count);
+    if (count == 0 || count > BATCH_MAX_RECORDS || length != BATCH_HEADER_SIZE + (size_t)count * BATCH_LANE)
+        return -1;
+    if (evaluate_batch(request + BATCH_HEADER_SIZE, count, responses) < 0)
+        return -1;
+    return count * sizeof(int16_t);
+}
+
+void add_connection(worker_t *worker, connection_t *connection)
+{
+    struct epoll_event event;
+    event.data.ptr = connection;
+    event.events = EPOLLIN;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0)
+        ERR("epoll_ctl");
+    connection->prev = NULL;
+    connection->next = worker->connections;
+    if (worker->connections != NULL)
+        worker->connections->prev = connection;
+    worker->connections = connection;
+    if (verbose)
+        printf("[%d]: Server added %d to epoll\n", getpid(), connection->fd);
+}
+
+/*
+ * Handles every whole record in the input buffer, the responses go out
+ * in one write. What the socket does not take now waits for EPOLLOUT,
+ * the connection is not read until its responses are gone.
+ */
+void serve_connection(worker_t *worker, connection_t *connection)
+{
+    if (connection->out_len == 0)
+    {
+        int eof;
+        ssize_t size =
+            sop_read_nonblock(connection->fd, connection->in + connection->in_len, IN_BUFFER_SIZE - connection->in_len, &eof);
+        if (size < 0 && errno != ECONNRESET)
+            ERR("sop_read_nonblock:");
+        if (size < 0 || eof)
+        {
+            close_connection(worker, connection);
+            return;
+        }
+        connection->in_len += size;
+        if (evaluate_requests(connection) < 0)
+        {
+            if (verbose)
+                fprintf(stderr, "[%d]: Malformed batch from %d\n", getpid(), connection->fd);
+            close_connection(worker, connection);
+            return;
+        }
+        connection->out_offset = 0;
+    }
+
+    ssize_t size = sop_write_nonblock(connection->fd, connection->out + connection->out_offset,
+                                      connection->out_len - connection->out_offset);
+    if (size < 0)
+    {
+        if (errno != EPIPE && errno != ECONNRESET)
+            ERR("sop_write_nonblock:");
+        close_connection(worker, connection);
+        return;
+    }
+    connection->out_offset += size;
+    int waiting = connection->out_offset < connection->out_len;
+    if (!waiting)
+        connection->out_len = connection->out_offset = 0;
+    if (waiting != connection->waiting)
+    {
+        struct epoll_event event;
+        event.data.ptr = connection;
+        event.events = waiting ? EPOLLOUT : EPOLLIN;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+            ERR("epoll_ctl");
+        connection->waiting = waiting;
+    }
+}
+
+void close_connection(worker_t *worker, connection_t *connection)
+{
+    int fd = connection->fd;
+    if (verbose)
+        printf("[%d]: Server removed %d from epoll\n", getpid(), fd);
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        ERR("epoll_ctl");
+    if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+        ERR("close");
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else
+        worker->connections = connection->next;
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+    free(connection);
+    if (verbose)
+        printf("[%d]: Server closed %d\n", getpid(), fd);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->connection_count--;
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+void worker_init(worker_t *worker)
+{
+    memset(worker, 0, sizeof(*worker));
+    if ((worker->epoll_fd = epoll_create1(0)) < 0)
         ERR("epoll_create:");
+    worker->event_fd = -1;
+    if (pthread_mutex_init(&worker->mutex, NULL))
+        ERR("pthread_mutex_init");
+}
+
+// Closes whatever connections are left, including those never picked up.
+void worker_destroy(worker_t *worker)
+{
+    worker_adopt(worker);
+    while (worker->connections != NULL)
+        close_connection(worker, worker->connections);
+    if (TEMP_FAILURE_RETRY(close(worker->epoll_fd)) < 0)
+        ERR("close");
+    if (worker->event_fd != -1 && TEMP_FAILURE_RETRY(close(worker->event_fd)) < 0)
+        ERR("close");
+    pthread_mutex_destroy(&worker->mutex);
+}
+
+// A single thread accepts and serves everything.
+void work(int server_socket, sigset_t oldmask)
+{
+    worker_t loop;
+    worker_init(&loop);
 
+    // The listening socket is told apart from the connections by a NULL pointer.
     struct epoll_event event, events[MAX_EVENTS];
-    event.data.fd = server_socket;
+    event.data.ptr = NULL;
     event.events = EPOLLIN;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0)
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0)
         ERR("epoll_ctl");
 
     int nfds;
-    char buffer[PID_LENGTH];
-    memset(buffer, 0, PID_LENGTH);
-    ssize_t size;
 
     while (do_work)
     {
-        if ((nfds = epoll_pwait(epoll_fd, events, MAX_EVENTS, -1, &oldmask)) > 0)
+        if ((nfds = epoll_pwait(loop.epoll_fd, events, MAX_EVENTS, -1, &oldmask)) > 0)
         {
             for (int i = 0; i < nfds; i++)
             {
-                int fd = events[i].data.fd;
-                if (fd == server_socket)
+                connection_t *connection = events[i].data.ptr;
+                if (connection == NULL)
                 {
                     int client_socket = sop_accept_client(server_socket);
-                    sop_setnonblock(client_socket);
-                    event.data.fd = client_socket;
-                    event.events = EPOLLIN;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0)
-                        ERR("epoll_ctl");
-                    
-                    printf("[%d]: Server added %d to epoll\n", getpid(), client_socket);
+                    if (client_socket == -1)
+                        continue;
+                    if ((connection = calloc(1, sizeof(connection_t))) == NULL)
+                        ERR("calloc");
+                    connection->fd = client_socket;
+                    loop.connection_count++;
+                    add_connection(&loop, connection);
                 }
                 else
-                {
-                    if ((size = sop_bulk_read(fd, buffer, PID_LENGTH)) < 0)
-                        ERR("sop_bulk_read:");
-                    else if (size == PID_LENGTH)
-                    {
-                        int16_t response = htons(evaluate_response(buffer));
-                        fprintf(stderr, "[%d]: Server evaluating response for %d\n", getpid(), fd);
-                        if (sop_bulk_write(fd, (char *)&response, sizeof(int16_t)) < 0 && errno != EPIPE)
-                            ERR("write:");
-                    }
-                    else if (size == 0)
-                    {
-                        printf("[%d]: Server removed %d from epoll\n", getpid(), fd);
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
-                            ERR("epoll_ctl");
-                        if (TEMP_FAILURE_RETRY(close(fd)) < 0)
-                            ERR("close");
-                        printf("[%d]: Server closed %d\n", getpid(), fd);
-                    }
-                }
+                    serve_connection(&loop, connection);
             }
         }
         else
@@ -127,6 +496,242 @@ void work(int server_socket, sigset_t oldmask)
             ERR("epoll_pwait");
         }
     }
-    if (TEMP_FAILURE_RETRY(close(epoll_fd)) < 0)
-        ERR("close");
-}
\ No newline at end of file
+    worker_destroy(&loop);
+}
+
+// Registers the connections the acceptor has queued for this worker.
+void worker_adopt(worker_t *worker)
+{
+    pthread_mutex_lock(&worker->mutex);
+    connection_t *pending = worker->pending;
+    worker->pending = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+
+    while (pending != NULL)
+    {
+        connection_t *connection = pending;
+        pending = pending->next;
+        add_connection(worker, connection);
+    }
+}
+
+void *worker_thread(void *arg)
+{
+    worker_t *worker = arg;
+    // The eventfd is told apart from the connections by a NULL pointer.
+    struct epoll_event event, events[MAX_EVENTS];
+    event.data.ptr = NULL;
+    event.events = EPOLLIN;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event) < 0)
+        ERR("epoll_ctl");
+
+    for (;;)
+    {
+        int nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (nfds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < nfds; i++)
+        {
+            connection_t *connection = events[i].data.ptr;
+            if (connection != NULL)
+            {
+                serve_connection(worker, connection);
+                continue;
+            }
+            uint64_t count;
+            if (TEMP_FAILURE_RETRY(read(worker->event_fd, &count, sizeof(count))) < 0 && errno != EAGAIN)
+                ERR("read");
+            pthread_mutex_lock(&worker->mutex);
+            int stopping = worker->stopping;
+            pthread_mutex_unlock(&worker->mutex);
+            if (stopping)
+                return NULL;
+            worker_adopt(worker);
+        }
+    }
+}
+
+worker_t *choose_worker(worker_t *workers, server_config_t *config, int *next)
+{
+    if (config->balance == BALANCE_ROUND_ROBIN)
+    {
+        worker_t *worker = &workers[*next];
+        *next = (*next + 1) % config->worker_count;
+        return worker;
+    }
+    worker_t *least = NULL;
+    int least_count = 0;
+    for (int i = 0; i < config->worker_count; i++)
+    {
+        pthread_mutex_lock(&workers[i].mutex);
+        int count = workers[i].connection_count;
+        pthread_mutex_unlock(&workers[i].mutex);
+        if (least == NULL || count < least_count)
+        {
+            least = &workers[i];
+            least_count = count;
+        }
+    }
+    return least;
+}
+
+/*
+ * The main thread only accepts: a new connection goes to the pending queue
+ * of a worker, round-robin or to the one with the fewest connections, and
+ * the worker is woken through its eventfd.
+ */
+void accept_loop(int server_socket, server_config_t *config, sigset_t oldmask)
+{
+    worker_t *workers = malloc(config->worker_count * sizeof(worker_t));
+    if (workers == NULL)
+        ERR("malloc");
+    for (int i = 0; i < config->worker_count; i++)
+    {
+        worker_init(&workers[i]);
+        if ((workers[i].event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            ERR("eventfd");
+        if (pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]))
+            ERR("pthread_create");
+    }
+    fprintf(stderr, "[%d]: Server runs %d workers\n", getpid(), config->worker_count);
+
+    struct pollfd listener = {server_socket, POLLIN, 0};
+    int next = 0;
+    uint64_t one = 1;
+    while (do_work)
+    {
+        if (ppoll(&listener, 1, NULL, &oldmask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("ppoll");
+        }
+        int client_socket;
+        while ((client_socket = sop_accept_client(server_socket)) != -1)
+        {
+            connection_t *connection = calloc(1, sizeof(connection_t));
+            if (connection == NULL)
+                ERR("calloc");
+            connection->fd = client_socket;
+            worker_t *worker = choose_worker(workers, config, &next);
+            pthread_mutex_lock(&worker->mutex);
+            connection->next = worker->pending;
+            worker->pending = connection;
+            worker->connection_count++;
+            pthread_mutex_unlock(&worker->mutex);
+            if (TEMP_FAILURE_RETRY(write(worker->event_fd, &one, sizeof(one))) < 0)
+                ERR("write");
+        }
+    }
+
+    for (int i = 0; i < config->worker_count; i++)
+    {
+        pthread_mutex_lock(&workers[i].mutex);
+        workers[i].stopping = 1;
+        pthread_mutex_unlock(&workers[i].mutex);
+        if (TEMP_FAILURE_RETRY(write(workers[i].event_fd, &one, sizeof(one))) < 0)
+            ERR("write");
+    }
+    for (int i = 0; i < config->worker_count; i++)
+    {
+        if (pthread_join(workers[i].tid, NULL))
+            ERR("pthread_join");
+        worker_destroy(&workers[i]);
+    }
+    free(workers);
+}
+
+/*
+ * Every wakeup drains the socket MAX_DATAGRAMS requests per recvmmsg and
+ * answers each batch of them with sendmmsg. Malformed requests are dropped
+ * without an answer, as a lost datagram would be.
+ */
+void serve_datagrams(int server_socket, sigset_t oldmask)
+{
+    datagrams_t *datagrams = malloc(sizeof(datagrams_t));
+    if (datagrams == NULL)
+        ERR("malloc");
+    memset(datagrams->requests, 0, sizeof(datagrams->requests));
+    memset(datagrams->responses, 0, sizeof(datagrams->responses));
+    for (int i = 0; i < MAX_DATAGRAMS; i++)
+    {
+        datagrams->request_iov[i].iov_base = datagrams->in[i];
+        datagrams->request_iov[i].iov_len = BATCH_FRAME_MAX;
+        datagrams->requests[i].msg_hdr.msg_iov = &datagrams->request_iov[i];
+        datagrams->requests[i].msg_hdr.msg_iovlen = 1;
+        datagrams->requests[i].msg_hdr.msg_name = &datagrams->addresses[i];
+        datagrams->response_iov[i].iov_base = datagrams->out[i];
+    }
+    fprintf(stderr, "[%d]: Server serves datagrams\n", getpid());
+
+    struct pollfd listener = {server_socket, POLLIN, 0};
+    while (do_work)
+    {
+        if (ppoll(&listener, 1, NULL, &oldmask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("ppoll");
+        }
+        for (;;)
+        {
+            // The kernel overwrites the address lengths.
+            for (int i = 0; i < MAX_DATAGRAMS; i++)
+                datagrams->requests[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            int count = recvmmsg(server_socket, datagrams->requests, MAX_DATAGRAMS, 0, NULL);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                ERR("recvmmsg");
+            }
+
+            int answered = 0;
+            for (int i = 0; i < count; i++)
+            {
+                struct msghdr *request = &datagrams->requests[i].msg_hdr;
+                ssize_t size = -1;
+                if (!(request->msg_flags & MSG_TRUNC))
+                    size = evaluate_datagram(datagrams->in[i], datagrams->requests[i].msg_len,
+                                             datagrams->out[answered]);
+                if (size < 0)
+                {
+                    if (verbose)
+                        fprintf(stderr, "[%d]: Malformed datagram dropped\n", getpid());
+                    continue;
+                }
+                struct msghdr *response = &datagrams->responses[answered].msg_hdr;
+                datagrams->response_iov[answered].iov_len = size;
+                response->msg_iov = &datagrams->response_iov[answered];
+                response->msg_iovlen = 1;
+                response->msg_name = request->msg_name;
+                response->msg_namelen = request->msg_namelen;
+                answered++;
+            }
+            if (verbose)
+                fprintf(stderr, "[%d]: Server evaluating %d datagrams\n", getpid(), answered);
+
+            // A full send buffer drops the rest, the clients time out as with any lost datagram.
+            for (int sent = 0; sent < answered;)
+            {
+                int size = sendmmsg(server_socket, datagrams->responses + sent, answered - sent, 0);
+                if (size < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        ERR("sendmmsg");
+                    break;
+                }
+                sent += size;
+            }
+        }
+    }
+    free(datagrams);
+}
@@ -1,27 +1,55 @@
+#pragma once
+
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
-#include <sys/select.h>
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 #define UNUSED(x) (void)(x)
 
 #define PID_LENGTH 11
 
+/*
+ * A batch request: BATCH_MAGIC, a reserved byte, the record count (uint16_t,
+ * network order) and as many NUL-padded lanes of digits. The response is one
+ * int16_t per record.
+ */
+#define BATCH_MAGIC 'B'
+#define BATCH_HEADER_SIZE 4
+#define BATCH_LANE 16
+#define BATCH_MAX_RECORDS 256
+#define BATCH_FRAME_MAX (BATCH_HEADER_SIZE + BATCH_MAX_RECORDS * BATCH_LANE)
+
 typedef void (*signalhandler_t)(int);
 
+// TCP options of the listening socket, like tcp_profile_t of the chat server.
+typedef struct sop_tcp_profile_t
+{
+    int nodelay;
+    int send_buffer;
+    int receive_buffer;
+    int defer_accept;
+    int keepalive_idle;
+    int keepalive_interval;
+    int keepalive_count;
+    int busy_poll;
+} sop_tcp_profile_t;
+
 int sop_sethandler(signalhandler_t f, int sigNo)
 {
     struct sigaction act;
@@ -32,6 +60,20 @@ int sop_sethandler(signalhandler_t f, int sigNo)
     return 0;
 }
 
+// Raises the soft descriptor limit up to wanted, as far as the hard limit allows. Returns the new limit.
+rlim_t sop_raise_fd_limit(rlim_t wanted)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    if (limit.rlim_cur >= wanted)
+        return limit.rlim_cur;
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+    return limit.rlim_cur;
+}
+
 int sop_setnonblock(int fd)
 {
     int oldflags = fcntl(fd, F_GETFL, 0);
@@ -41,6 +83,57 @@ int sop_setnonblock(int fd)
     return fcntl(fd, F_SETFL, oldflags);
 }
 
+// none: kernel defaults, latency: small requests, throughput: bulk transfers.
+int sop_tcp_profile_parse(const char *name, sop_tcp_profile_t *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    if (strcmp(name, "none") == 0)
+        return 0;
+    profile->keepalive_idle = 60;
+    profile->keepalive_interval = 10;
+    profile->keepalive_count = 6;
+    if (strcmp(name, "latency") == 0)
+    {
+        profile->nodelay = 1;
+        return 0;
+    }
+    if (strcmp(name, "throughput") == 0)
+    {
+        profile->send_buffer = 1 << 20;
+        profile->receive_buffer = 1 << 20;
+        return 0;
+    }
+    return -1;
+}
+
+void sop_setsockopt(int fd, int level, int name, int value)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)))
+        ERR("setsockopt");
+}
+
+void sop_apply_listener_profile(int fd, const sop_tcp_profile_t *profile)
+{
+    if (profile->nodelay)
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (profile->send_buffer > 0)
+        sop_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, profile->send_buffer);
+    if (profile->receive_buffer > 0)
+        sop_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, profile->receive_buffer);
+    if (profile->defer_accept > 0)
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept);
+    if (profile->keepalive_idle > 0)
+    {
+        sop_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, profile->keepalive_idle);
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, profile->keepalive_interval);
+        sop_setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, profile->keepalive_count);
+    }
+    if (profile->busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll, sizeof(int)) &&
+        errno != EPERM)
+        ERR("setsockopt");
+}
+
 int sop_make_sockstream()
 {
     int sock;
@@ -78,7 +171,7 @@ int sop_connect_sockstream(char *name, char *port)
     return socketfd;
 }
 
-int sop_bind_sockstream(uint16_t port, int backlog)
+int sop_bind_sockstream(uint16_t port, int backlog, const sop_tcp_profile_t *profile)
 {
     struct sockaddr_in addr;
     int socketfd, t = 1;
@@ -89,6 +182,8 @@ int sop_bind_sockstream(uint16_t port, int backlog)
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
         ERR("setsockopt");
+    if (profile != NULL)
+        sop_apply_listener_profile(socketfd, profile);
     if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
         ERR("bind");
     if (listen(socketfd, backlog) < 0)
@@ -96,37 +191,79 @@ int sop_bind_sockstream(uint16_t port, int backlog)
     return socketfd;
 }
 
+int sop_make_sockdgram()
+{
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        ERR("socket");
+    return sock;
+}
+
+// A connected datagram socket only talks to the server and can use read and write.
+int sop_connect_sockdgram(char *name, char *port)
+{
+    struct sockaddr_in addr;
+    int socketfd;
+    socketfd = sop_make_sockdgram();
+    addr = sop_make_address(name, port);
+    if (connect(socketfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0)
+        ERR("connect");
+    return socketfd;
+}
+
+int sop_bind_sockdgram(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int socketfd, t = 1;
+    socketfd = sop_make_sockdgram();
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ERR("bind");
+    return socketfd;
+}
+
+/*
+ * The accepted socket is non-blocking and close-on-exec from the start,
+ * accept4 saves the two fcntl calls of sop_setnonblock.
+ * Returns -1 if no connection is waiting.
+ */
 int sop_accept_client(int server_socket)
 {
     int nfd;
-    if ((nfd = TEMP_FAILURE_RETRY(accept(server_socket, NULL, NULL))) < 0)
+    if ((nfd = TEMP_FAILURE_RETRY(accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) < 0)
     {
-        if (EAGAIN == errno || EWOULDBLOCK == errno)
+        if (EAGAIN == errno || EWOULDBLOCK == errno || ECONNABORTED == errno)
             return -1;
-        ERR("accept");
+        ERR("accept4");
     }
     return nfd;
 }
 
+/*
+ * Reads count bytes unless the stream ends first. A non-blocking socket
+ * is waited for with poll, but only once it has nothing left to read,
+ * so a socket with data costs no extra system call.
+ */
 ssize_t sop_bulk_read(int fd, char *buf, size_t count)
 {
     int c;
     size_t len = 0;
 
-    fd_set read_fds;
-
     do
     {
-        FD_ZERO(&read_fds);
-        FD_SET(fd, &read_fds);
-
-        int ready = select(fd + 1, &read_fds, NULL, NULL, NULL);
-        if (ready < 0)
-            return -1;
-        if (!FD_ISSET(fd, &read_fds))
-            continue;
-
         c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            struct pollfd ready = {fd, POLLIN, 0};
+            if (TEMP_FAILURE_RETRY(poll(&ready, 1, -1)) < 0)
+                return -1;
+            continue;
+        }
         if (c < 0)
             return c;
         if (0 == c)
@@ -152,4 +289,39 @@ ssize_t sop_bulk_write(int fd, char *buf, size_t count)
         count -= c;
     } while (count > 0);
     return len;
-}
\ No newline at end of file
+}
+
+/*
+ * Reads at most count bytes a non-blocking socket has. Returns 0 if there was
+ * nothing yet, -1 with errno set on error, *eof is set at the end of the stream.
+ */
+ssize_t sop_read_nonblock(int fd, char *buf, size_t count, int *eof)
+{
+    *eof = 0;
+    ssize_t c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+    if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (c == 0 && count > 0)
+        *eof = 1;
+    return c;
+}
+
+/*
+ * Writes as much as a non-blocking socket takes right now. Returns the
+ * number of bytes written, less than count if the socket is full, or -1
+ * with errno set.
+ */
+ssize_t sop_write_nonblock(int fd, char *buf, size_t count)
+{
+    size_t len = 0;
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(fd, buf + len, count - len));
+        if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (c < 0)
+            return -1;
+        len += c;
+    }
+    return len;
+}